@@ -0,0 +1,382 @@
+#include <fstream>
+#include <ios>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <random>
+#include "artwork.h"
+#include "id3codec.h"
+#include "audiofile.h"
+#include "fileio.h"
+#include "oggfile.h"
+#include "mp4file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+typedef unsigned char byte;
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+static uint32_t read_be(const byte* p, int n)
+{
+    uint32_t ret = 0;
+    for (int i = 0; i != n; ++i)
+        ret = ret << 8 | p[i];
+    return ret;
+}
+
+template <int Version>
+static vector<ArtworkRef> find_id3_frames(std::ifstream& mediafile,
+                                          uintmax_t tag_end, const char* apic)
+{
+    typedef Id3Frame<Version> Frame;
+    vector<ArtworkRef> ret;
+    uintmax_t pos = 10;
+    while (pos + Frame::header_size <= tag_end)
+    {
+        byte frame[Frame::header_size]{};
+        mediafile.seekg(pos);
+        mediafile.read(reinterpret_cast<char*>(frame), Frame::header_size);
+        uint32_t framesize = 0;
+        if (!mediafile || !Frame::read(frame, tag_end - pos, framesize))
+            break;  // reached padding
+        uintmax_t body = pos + Frame::header_size;
+        pos = body + framesize;
+        if (string(frame, frame + Frame::id_size) != apic || framesize < 4)
+            continue;
+        
+        // encoding(1), mime (null-terminated), picture type(1), then a
+        // description terminated by one null, or two for UTF-16
+        vector<char> prefix(std::min<uint32_t>(framesize, 1024));
+        mediafile.read(prefix.data(), prefix.size());
+        byte encoding = prefix[0];
+        size_t i = 1;
+        string mime;
+        if constexpr (Version == 2)
+        {
+            // a three letter image format in place of the mime type
+            string format(prefix.begin() + 1, prefix.begin() + 4);
+            for (auto& ch : format)
+                ch = tolower(ch);
+            mime = "image/" + (format == "jpg" ? string("jpeg") : format);
+            i = 5; // format and picture type
+        }
+        else
+        {
+            while (i < prefix.size() && prefix[i] != 0)
+                mime.push_back(prefix[i++]);
+            i += 2; // null and picture type
+        }
+        if (encoding == 1 || encoding == 2)
+        {
+            while (i + 1 < prefix.size() && (prefix[i] || prefix[i + 1]))
+                i += 2;
+            i += 2;
+        }
+        else
+        {
+            while (i < prefix.size() && prefix[i] != 0)
+                ++i;
+            i += 1;
+        }
+        if (i >= framesize)
+            continue;
+        ret.push_back({ body + i, framesize - i, mime, {} });
+    }
+    return ret;
+}
+
+static vector<ArtworkRef> find_id3_artwork(std::ifstream& mediafile)
+{
+    byte head[10]{};
+    mediafile.read(reinterpret_cast<char*>(head), 10);
+    if (!mediafile || head[0] != 'I' || head[1] != 'D' || head[2] != '3')
+        return vector<ArtworkRef>();
+    uintmax_t tag_end = 10 + TagSizeCodec::decode(head + 6);
+    switch (head[3])
+    {
+    case 2:
+        return find_id3_frames<2>(mediafile, tag_end, "PIC");
+    case 3:
+        return find_id3_frames<3>(mediafile, tag_end, "APIC");
+    case 4:
+        return find_id3_frames<4>(mediafile, tag_end, "APIC");
+    default:
+        return vector<ArtworkRef>();
+    }
+}
+
+static vector<ArtworkRef> find_flac_artwork(std::ifstream& mediafile)
+{
+    vector<ArtworkRef> ret;
+    byte magic[4]{};
+    mediafile.read(reinterpret_cast<char*>(magic), 4);
+    if (!mediafile || string(magic, magic + 4) != "fLaC")
+        return ret;
+    
+    uintmax_t pos = 4;
+    bool lastblock = false;
+    while (!lastblock)
+    {
+        byte blockinfo[4]{};
+        mediafile.seekg(pos);
+        mediafile.read(reinterpret_cast<char*>(blockinfo), 4);
+        if (!mediafile)
+            break;
+        lastblock = blockinfo[0] >> 7;
+        byte blockbyte = blockinfo[0] & 0b01111111;
+        uint32_t blocksize = read_be(blockinfo + 1, 3);
+        uintmax_t body = pos + 4;
+        pos = body + blocksize;
+        if (blockbyte != 6)
+            continue;
+        
+        // type(4), mime length(4), mime, description length(4),
+        // description, width/height/depth/colors(16), data length(4)
+        byte field[4]{};
+        mediafile.seekg(body + 4);
+        mediafile.read(reinterpret_cast<char*>(field), 4);
+        string mime(read_be(field, 4), '\0');
+        mediafile.read(mime.data(), mime.size());
+        mediafile.read(reinterpret_cast<char*>(field), 4);
+        mediafile.seekg(read_be(field, 4) + 16, std::ios_base::cur);
+        mediafile.read(reinterpret_cast<char*>(field), 4);
+        if (!mediafile)
+            break;
+        uintmax_t data_start = mediafile.tellg();
+        ret.push_back({ data_start, read_be(field, 4), mime, {} });
+    }
+    return ret;
+}
+
+static vector<byte> base64_decode(const string& text)
+{
+    static const string digits =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    vector<byte> ret;
+    ret.reserve(text.size() / 4 * 3);
+    uint32_t bits = 0;
+    int have = 0;
+    for (char ch : text)
+    {
+        size_t digit = digits.find(ch);
+        if (digit == string::npos)
+            continue;  // padding, line breaks
+        bits = bits << 6 | static_cast<uint32_t>(digit);
+        have += 6;
+        if (have >= 8)
+        {
+            have -= 8;
+            ret.push_back(static_cast<byte>(bits >> have));
+        }
+    }
+    return ret;
+}
+
+// a FLAC PICTURE block held in memory, as Ogg carries it
+static bool picture_from_block(const vector<byte>& block, ArtworkRef& art)
+{
+    size_t pos = 4;  // picture type
+    auto field = [&block, &pos] (uint32_t& v)
+    {
+        if (block.size() - pos < 4)
+            return false;
+        v = read_be(&block[pos], 4);
+        pos += 4;
+        return true;
+    };
+    uint32_t n = 0;
+    if (block.size() < 8 || !field(n) || block.size() - pos < n)
+        return false;
+    art.mime.assign(block.begin() + pos, block.begin() + pos + n);
+    pos += n;
+    if (!field(n) || block.size() - pos < uintmax_t(n) + 16)
+        return false;
+    pos += n + 16;
+    if (!field(n) || block.size() - pos < n)
+        return false;
+    art.offset = 0;
+    art.length = n;
+    art.data.assign(block.begin() + pos, block.begin() + pos + n);
+    return true;
+}
+
+static vector<ArtworkRef> find_ogg_artwork(const string& path)
+{
+    vector<ArtworkRef> ret;
+    OggFile ogg(path);
+    const TagMap& tags = ogg.get_qtags();
+    auto picture = tags.find("METADATA_BLOCK_PICTURE");
+    ArtworkRef art{};
+    if (picture != tags.end() &&
+        picture_from_block(base64_decode(picture->second), art))
+        ret.push_back(std::move(art));
+    // the older unofficial field, a bare image
+    auto coverart = tags.find("COVERART");
+    if (coverart != tags.end())
+    {
+        auto mime = tags.find("COVERARTMIME");
+        ArtworkRef old{};
+        old.data = base64_decode(coverart->second);
+        old.length = old.data.size();
+        old.mime = mime != tags.end() ? mime->second : "image/jpeg";
+        ret.push_back(std::move(old));
+    }
+    return ret;
+}
+
+static vector<ArtworkRef> find_mp4_artwork(const string& path)
+{
+    vector<ArtworkRef> ret;
+    for (const auto& cover : mp4_covers(path))
+        ret.push_back({ cover.offset, cover.length,
+                        cover.data_type == 14 ? "image/png"
+                        : cover.data_type == 27 ? "image/bmp" : "image/jpeg",
+                        {} });
+    return ret;
+}
+
+vector<ArtworkRef> find_artwork(const string& path)
+{
+    std::ifstream mediafile(path, std::ios_base::binary);
+    if (!mediafile)
+        throw std::runtime_error("Unable to open " + path);
+    
+    FilePrefix prefix = read_prefix(path);
+    switch (sniff_format(prefix.bytes.data(), prefix.bytes.size()))
+    {
+    case AudioFormat::Flac:
+        return find_flac_artwork(mediafile);
+    case AudioFormat::Ogg:
+        return find_ogg_artwork(path);
+    case AudioFormat::Mp4:
+        return find_mp4_artwork(path);
+    default:
+        return find_id3_artwork(mediafile);
+    }
+}
+
+static string mime_extension(const string& mime)
+{
+    if (mime == "image/jpeg" || mime == "image/jpg")
+        return ".jpg";
+    else if (mime == "image/png")
+        return ".png";
+    else if (mime == "image/gif")
+        return ".gif";
+    return ".bin";
+}
+
+// a new empty file in dir that no other run will pick too
+static string unique_partial(const string& dir)
+{
+    string name = (fs::path(dir) / ".cover.XXXXXX").string();
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::mkstemp(name.data());
+    if (fd < 0)
+        throw std::runtime_error("Unable to create a file in " + dir);
+    ::close(fd);
+#else
+    static std::random_device random;
+    std::snprintf(name.data() + name.size() - 6, 7, "%06x",
+                  static_cast<unsigned>(random()) & 0xFFFFFF);
+    std::ofstream(name, std::ios_base::binary);
+#endif
+    return name;
+}
+
+static bool same_contents(const fs::path& a, const fs::path& b)
+{
+    if (fs::file_size(a) != fs::file_size(b))
+        return false;
+    std::ifstream x(a, std::ios_base::binary), y(b, std::ios_base::binary);
+    vector<char> xs(65536), ys(65536);
+    while (x && y)
+    {
+        x.read(xs.data(), xs.size());
+        y.read(ys.data(), ys.size());
+        if (x.gcount() != y.gcount() ||
+            !std::equal(xs.begin(), xs.begin() + x.gcount(), ys.begin()))
+            return false;
+    }
+    return true;
+}
+
+vector<string> extract_artwork(const string& path, const string& outdir)
+{
+    vector<string> ret;
+    fs::create_directories(outdir);
+    std::ifstream mediafile(path, std::ios_base::binary);
+    
+    for (const auto& art : find_artwork(path))
+    {
+        // copy in fixed chunks, hashing (FNV-1a) on the way through
+        string partial = unique_partial(outdir);
+        std::ofstream out(partial, std::ios_base::binary | std::ios_base::trunc);
+        mediafile.clear();
+        mediafile.seekg(art.offset);
+        
+        uint64_t hash = 14695981039346656037ull;
+        vector<char> chunk(65536);
+        uintmax_t left = art.length;
+        size_t from_data = 0;
+        while (left != 0)
+        {
+            size_t n = std::min<uintmax_t>(left, chunk.size());
+            if (!art.data.empty())
+            {
+                std::copy_n(art.data.begin() + from_data, n, chunk.begin());
+                from_data += n;
+            }
+            else
+            {
+                mediafile.read(chunk.data(), n);
+                n = mediafile.gcount();
+            }
+            if (n == 0)
+                break;
+            for (size_t i = 0; i != n; ++i)
+                hash = (hash ^ byte(chunk[i])) * 1099511628211ull;
+            out.write(chunk.data(), n);
+            left -= n;
+        }
+        out.close();
+        if (left != 0 || !out)
+        {
+            fs::remove(partial);
+            throw std::runtime_error("Short read extracting artwork from " + path);
+        }
+        
+        // the hash only picks the name; a different image that happens
+        // to share it gets a numbered one
+        char name[32];
+        std::snprintf(name, sizeof name, "cover-%016llx",
+                      static_cast<unsigned long long>(hash));
+        fs::path cover;
+        for (int n = 0; ; ++n)
+        {
+            string suffix = n == 0 ? "" : "-" + std::to_string(n);
+            cover = fs::path(outdir) / (name + suffix + mime_extension(art.mime));
+            if (!fs::exists(cover))
+            {
+                fs::rename(partial, cover);
+                break;
+            }
+            if (same_contents(partial, cover))
+            {
+                fs::remove(partial);  // same image already extracted
+                break;
+            }
+        }
+        ret.push_back(cover.string());
+    }
+    return ret;
+}
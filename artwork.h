@@ -0,0 +1,31 @@
+#ifndef ARTWORK_H
+#define ARTWORK_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// location of one embedded image inside an audio file; only the small
+// frame/block headers are read to find it, never the image itself.
+// an Ogg picture is base64 inside a comment, so it comes decoded in data
+// instead, with offset 0
+struct ArtworkRef
+{
+    uintmax_t offset;   // first byte of the image data
+    uintmax_t length;
+    std::string mime;
+    std::vector<unsigned char> data;
+};
+
+// APIC frames for MP3, PICTURE blocks (type 6) for FLAC,
+// METADATA_BLOCK_PICTURE comments for Ogg and covr items for MP4, going
+// by the file's content rather than its name
+std::vector<ArtworkRef> find_artwork(const std::string& path);
+
+// stream every embedded image of path into outdir, named by a hash of its
+// content so identical covers across an album end up in one shared file.
+// returns the cover files path refers to; throws if an image is cut short
+std::vector<std::string> extract_artwork(const std::string& path,
+                                         const std::string& outdir);
+
+#endif // ARTWORK_H
@@ -0,0 +1,89 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include "audiofile.h"
+#include "mpegscan.h"
+#include "id3v1.h"
+#include "musfile.h"
+#include "flacfile.h"
+#include "oggfile.h"
+#include "mp4file.h"
+
+namespace fs = std::filesystem;
+
+std::vector<std::string> list_audio_files(const std::string& dir)
+{
+    std::vector<std::string> ret;
+    for (const auto& entry : fs::recursive_directory_iterator(dir))
+    {
+        if (!entry.is_regular_file())
+            continue;
+        std::string ext = entry.path().extension().string();
+        for (auto& ch : ext)
+            ch = tolower(ch);
+        if (ext == ".mp3" || ext == ".flac" || ext == ".ogg" ||
+            ext == ".oga" || ext == ".opus" || ext == ".m4a" ||
+            ext == ".m4b" || ext == ".mp4")
+            ret.push_back(entry.path().string());
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+AudioFormat sniff_format(const unsigned char* data, size_t n)
+{
+    auto has = [data, n] (size_t at, const char* magic)
+    {
+        size_t len = std::strlen(magic);
+        return n >= at + len && std::memcmp(data + at, magic, len) == 0;
+    };
+    if (has(0, "ID3"))
+        return AudioFormat::Mp3;
+    if (has(0, "fLaC"))
+        return AudioFormat::Flac;
+    if (has(0, "OggS"))
+        return AudioFormat::Ogg;
+    if (has(4, "ftyp"))
+        return AudioFormat::Mp4;
+    // no ID3v2 tag, so MPEG frames, perhaps after some junk
+    for (size_t i = 0; i + 4 <= n; ++i)
+        if (data[i] == 0xFF && mpeg_frames_at(data + i, n - i))
+            return AudioFormat::Mp3;
+    return AudioFormat::Unknown;
+}
+
+AudioFormat detect_format(const std::string& path, const FilePrefix& prefix)
+{
+    AudioFormat format = sniff_format(prefix.bytes.data(), prefix.bytes.size());
+    // an ID3v1-only file need not start with a clean frame, but ends in TAG
+    if (format == AudioFormat::Unknown && read_tail(path, prefix).has_v1)
+        format = AudioFormat::Mp3;
+    return format;
+}
+
+AudioFormat detect_format(const std::string& path)
+{
+    return detect_format(path, read_prefix(path));
+}
+
+AudioFile* open_audio_file(std::string_view filename)
+{
+    std::string path(filename);
+    FilePrefix prefix = read_prefix(path);
+    switch (detect_format(path, prefix))
+    {
+    case AudioFormat::Mp3:
+        return new MusFile(filename, std::move(prefix));
+    case AudioFormat::Flac:
+        return new FlacFile(filename, std::move(prefix));
+    case AudioFormat::Ogg:
+        return new OggFile(filename, std::move(prefix));
+    case AudioFormat::Mp4:
+        return new Mp4File(filename, std::move(prefix));
+    default:
+        throw std::runtime_error("Not a recognised audio file: " + path);
+    }
+}
@@ -1,19 +1,62 @@
 #ifndef AUDIOFILE_H
 #define AUDIOFILE_H
 
-#include <QString>
-#include <QLineEdit>
-#include <QProgressBar>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include "fileio.h"
 
+// tag/frame name to UTF-8 value
+typedef std::map<std::string, std::string> TagMap;
 
 class AudioFile
 {
 public:
-    AudioFile() = default;
-    virtual std::map<QString, QString>& get_qtags() = 0;
-    virtual std::map<QString, QString> get_standard() = 0;
+    // prefix, if given, is the start of the file as read_prefix left it;
+    // the parser takes its first bytes from there
+    explicit AudioFile(FilePrefix prefix = FilePrefix())
+        : prefix(std::move(prefix)) { }
+    virtual TagMap& get_qtags() = 0;
+    virtual TagMap get_standard() = 0;
     virtual bool write_qtags() = 0;
+    virtual std::string get_filename() const = 0;
+    // where the last write_qtags put its output
+    virtual std::string get_outfile() const = 0;
+    // free the raw tag/metadata buffers, keeping only the tag map resident;
+    // whatever write_qtags needs is reopened from disk on demand
+    virtual void drop_buffers() = 0;
+    virtual size_t resident_bytes() const = 0;
+    // drop embedded pictures on the next write and shrink the tag to match
+    virtual void strip_pictures() = 0;
+    // write_qtags edits the file itself instead of writing a copy into
+    // an album-named directory
+    void set_in_place(bool b) { in_place = b; }
     virtual ~AudioFile() = default;
+protected:
+    bool in_place = false;
+    FilePrefix prefix;  // given up to the first parse
+
 };
 
+// every .mp3/.flac/.ogg/.oga/.opus/.m4a/.m4b/.mp4 under dir, recursively
+std::vector<std::string> list_audio_files(const std::string& dir);
+
+enum class AudioFormat { Unknown, Mp3, Flac, Ogg, Mp4 };
+
+// the container, from ID3/fLaC/OggS/ftyp signatures or MPEG frame sync
+AudioFormat sniff_format(const unsigned char* data, size_t n);
+// what open_audio_file would open path as: sniff_format over its prefix,
+// or Mp3 for an ID3v1 tail on an otherwise unknown file
+AudioFormat detect_format(const std::string& path, const FilePrefix& prefix);
+AudioFormat detect_format(const std::string& path);
+
+// picks MusFile, FlacFile, OggFile or Mp4File for filename from its first
+// 64 KB, which the parser then reuses, or from an ID3v1 tail; throws if
+// none of them fits.
+// caller owns the result
+AudioFile* open_audio_file(std::string_view filename);
+
 #endif // AUDIOFILE_H
@@ -0,0 +1,150 @@
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include "batch.h"
+#include "iosched.h"
+
+using std::vector;
+using std::string;
+
+string escape_line(const string& text)
+{
+    string ret;
+    for (char ch : text)
+        if (ch == '\\')
+            ret += "\\\\";
+        else if (ch == '\n')
+            ret += "\\n";
+        else
+            ret += ch;
+    return ret;
+}
+
+string unescape_line(const string& line)
+{
+    string ret;
+    for (size_t i = 0; i != line.size(); ++i)
+        if (line[i] == '\\' && i + 1 != line.size())
+            ret += line[++i] == 'n' ? '\n' : line[i];
+        else
+            ret += line[i];
+    return ret;
+}
+
+namespace {
+
+// the paths logged in checkpoint. an unterminated last line is a write
+// cut short, not a finished file; complete tells whether there was one
+std::unordered_set<string> read_checkpoint(const string& checkpoint,
+                                           bool& complete)
+{
+    std::ifstream in(checkpoint, std::ios_base::binary);
+    std::stringstream text;
+    text << in.rdbuf();
+    string lines = text.str();
+    std::unordered_set<string> ret;
+    size_t begin = 0;
+    for (size_t end; (end = lines.find('\n', begin)) != string::npos;
+         begin = end + 1)
+        ret.insert(unescape_line(lines.substr(begin, end - begin)));
+    complete = begin == lines.size();
+    return ret;
+}
+
+}
+
+BatchResult run_batch(const vector<string>& paths,
+                      const std::function<bool(const string&)>& work,
+                      const string& checkpoint, unsigned threads)
+{
+    BatchResult result;
+    std::unordered_set<string> finished;
+    std::ofstream log;
+    if (!checkpoint.empty())
+    {
+        bool complete = true;
+        finished = read_checkpoint(checkpoint, complete);
+        log.open(checkpoint, std::ios_base::binary | std::ios_base::app);
+        if (!log)
+            throw std::runtime_error("Unable to open checkpoint " + checkpoint);
+        if (!complete)
+            log << '\n';
+    }
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, std::max<size_t>(paths.size(), 1));
+
+    // workers take paths in io_order off a shared counter; the result
+    // and the checkpoint log are only touched under result_mutex
+    vector<size_t> order = io_order(paths);
+    std::atomic<size_t> next{0};
+    std::mutex result_mutex;
+    auto run = [&]
+    {
+        for (size_t k = next++; k < order.size(); k = next++)
+        {
+            const string& path = paths[order[k]];
+            if (finished.count(path) != 0)
+            {
+                std::lock_guard<std::mutex> lock(result_mutex);
+                ++result.resumed;
+                continue;
+            }
+            string error;
+            try
+            {
+                if (!work(path))
+                    error = "failed";
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+            std::lock_guard<std::mutex> lock(result_mutex);
+            if (!error.empty())
+            {
+                result.errors.push_back(path + ": " + error);
+                continue;
+            }
+            ++result.done;
+            if (log.is_open())
+            {
+                // flushed per file, so a killed run loses at most the ones
+                // it was in the middle of
+                log << escape_line(path) << '\n';
+                log.flush();
+            }
+        }
+    };
+    if (threads == 1)
+        run();
+    else
+    {
+        vector<std::thread> pool;
+        for (unsigned i = 0; i != threads; ++i)
+            pool.emplace_back(run);
+        for (auto& t : pool)
+            t.join();
+    }
+    return result;
+}
+
+vector<string> unfinished(const vector<string>& paths, const string& checkpoint)
+{
+    if (checkpoint.empty())
+        return paths;
+    bool complete = true;
+    auto finished = read_checkpoint(checkpoint, complete);
+    vector<string> ret;
+    for (const auto& path : paths)
+        if (finished.count(path) == 0)
+            ret.push_back(path);
+    return ret;
+}
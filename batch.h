@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+struct BatchResult
+{
+    size_t done = 0;
+    size_t resumed = 0;  // finished by an earlier run, so not redone
+    std::vector<std::string> errors;
+};
+
+// one path (or message) per line of a file: a line break or backslash
+// in it is escaped, and unescape_line undoes that
+std::string escape_line(const std::string& text);
+std::string unescape_line(const std::string& line);
+
+// runs work on each path, in io_order, without letting one file stop the
+// rest: a throw or a false return is recorded as that file's error.
+// given a checkpoint file, each path that succeeds is appended to it as
+// soon as it does, and paths already there from an interrupted run are
+// skipped, so rerunning the same job only does what's left. given more
+// than one thread (0 = one per core), work runs on several paths at once
+BatchResult run_batch(const std::vector<std::string>& paths,
+                      const std::function<bool(const std::string&)>& work,
+                      const std::string& checkpoint = "",
+                      unsigned threads = 1);
+
+// the paths not yet logged in checkpoint, for a job that would rather not
+// even load the finished ones again
+std::vector<std::string> unfinished(const std::vector<std::string>& paths,
+                                    const std::string& checkpoint);
+
+#endif // BATCH_H
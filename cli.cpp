@@ -0,0 +1,620 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <chrono>
+#include <atomic>
+#include <csignal>
+#include <memory>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include "cli.h"
+#include "audiofile.h"
+#include "artwork.h"
+#include "payload.h"
+#include "mpegscan.h"
+#include "tagindex.h"
+#include "watcher.h"
+#include "tagexport.h"
+#include "rules.h"
+#include "journal.h"
+#include "mp4file.h"
+#include "daemon.h"
+#include "batch.h"
+#include "shard.h"
+
+using std::string;
+using std::vector;
+
+// set by --journal=<file>: batch writes record the original tags of the
+// files they edit there first
+static std::unique_ptr<TagJournal> journal;
+
+// set by --checkpoint=<file>: batch writes log each finished file there
+// and a rerun skips them
+static string checkpoint;
+
+// set by --shard-worker=K/N: batch commands only do the files of shard K,
+// and their counts and errors are kept for the coordinator to merge
+static ShardSpec shard;
+static ShardResult shard_result;
+
+// set by --memory-budget=<MB>: what --serve's tag cache may hold
+static size_t cache_budget = size_t(64) << 20;
+
+static void tally(const string& what, uintmax_t n)
+{
+    shard_result.counts[what] += n;
+}
+
+static void print_errors(const vector<string>& errors)
+{
+    for (const auto& error : errors)
+        std::cerr << error << '\n';
+    shard_result.errors.insert(shard_result.errors.end(), errors.begin(),
+                               errors.end());
+}
+
+static int usage()
+{
+    std::cerr << "usage:\n"
+              << "  --extract-art <outdir> <files...>\n"
+              << "  --strip-art <files...>\n"
+              << "  --hash <files...>\n"
+              << "  --duplicates <files...>\n"
+              << "  --audio-info <mp3 files...>\n"
+              << "  --mp4-layout <mp4 files...>\n"
+              << "  --query <dir> <key> <op> <value> [<key> <op> <value>...]\n"
+              << "      op: = (exact), ^= (prefix), ~ (contains), <, >=\n"
+              << "  --watch <dir>\n"
+              << "  --serve <socket> [dir]\n"
+              << "  --export <dir> <out.tagc|out.csv|out.jsonl>\n"
+              << "  --view <in.tagc> <out.csv|out.jsonl>\n"
+              << "  --import <diff.tagc>\n"
+              << "  --rules <rule file> <dir> [--dry-run]\n"
+              << "  --revert <journal> [batch]\n"
+              << "--strip-art, --import and --rules edit files in place;\n"
+              << "--journal=<file> records their original tags for --revert\n"
+              << "(and --serve record its writes)\n"
+              << "--memory-budget=<MB> caps the parsed tags --serve keeps\n"
+              << "cached (default 64)\n"
+              << "--checkpoint=<file> logs each file --strip-art, --import and\n"
+              << "--rules finish there; rerun with it to skip those files\n"
+              << "--shards=<n> --shard-dir=<dir> runs --strip-art, --import or\n"
+              << "--rules as n worker processes, each given the files that hash\n"
+              << "to it, and merges their results. a rerun only runs the shards\n"
+              << "with no result in dir or with failed files, retrying just\n"
+              << "those, and refuses a dir left by a run with other arguments,\n"
+              << "shard count or input files;\n"
+              << "--shard-worker=<k>/<n> --shard-dir=<dir>\n"
+              << "runs shard k alone, e.g. on another machine. shard k\n"
+              << "journals to <file>.<k> and checkpoints in dir\n";
+    return 2;
+}
+
+static int extract_art(const string& outdir, const vector<string>& files)
+{
+    for (const auto& file : files)
+        for (const auto& cover : extract_artwork(file, outdir))
+            std::cout << file << " -> " << cover << '\n';
+    return 0;
+}
+
+// what a batch left undone, on stderr
+static int report(const BatchResult& batch)
+{
+    print_errors(batch.errors);
+    tally("files written", batch.done);
+    tally("files done by an earlier run", batch.resumed);
+    if (batch.resumed != 0)
+        std::cerr << batch.resumed << " files already done per the checkpoint\n";
+    return batch.errors.empty() ? 0 : 1;
+}
+
+static int strip_art(const vector<string>& files)
+{
+    return report(run_batch(in_shard(files, shard), [] (const string& file)
+    {
+        std::unique_ptr<AudioFile> audio(open_audio_file(file));
+        if (journal)
+            journal->record(file);
+        // the album-folder copy is the tagger's own output layout; here
+        // the file itself loses its art, through a temporary and rename
+        audio->set_in_place(true);
+        audio->strip_pictures();
+        return audio->write_qtags();
+    }, checkpoint));
+}
+
+static int hash_files(const vector<string>& files)
+{
+    vector<string> errors;
+    auto hashes = hash_payloads(files, &errors);
+    for (size_t i = 0; i != files.size(); ++i)
+    {
+        if (!hashes[i].valid)
+            continue;
+        char hex[17];
+        std::snprintf(hex, sizeof hex, "%016llx",
+                      static_cast<unsigned long long>(hashes[i].hash));
+        std::cout << hex << "  " << files[i] << '\n';
+    }
+    for (const auto& error : errors)
+        std::cerr << error << '\n';
+    return errors.empty() ? 0 : 1;
+}
+
+static int find_duplicates(const vector<string>& files)
+{
+    // same audio payload, whatever the tags say. equal length and hash
+    // only make candidates, each is compared byte for byte with the
+    // first of every set found so far
+    vector<string> errors;
+    auto hashes = hash_payloads(files, &errors);
+    std::map<PayloadHash, vector<size_t>> candidates;
+    for (size_t i = 0; i != files.size(); ++i)
+        if (hashes[i].valid)
+            candidates[hashes[i]].push_back(i);
+    for (const auto& group : candidates)
+    {
+        if (group.second.size() < 2)
+            continue;
+        vector<vector<size_t>> sets;
+        for (auto i : group.second)
+        {
+            auto match = std::find_if(sets.begin(), sets.end(),
+                [&] (const vector<size_t>& set)
+                { return same_payload(files[set[0]], files[i]); });
+            if (match != sets.end())
+                match->push_back(i);
+            else
+                sets.push_back({ i });
+        }
+        for (const auto& set : sets)
+        {
+            if (set.size() < 2)
+                continue;
+            for (auto i : set)
+                std::cout << files[i] << '\n';
+            std::cout << '\n';
+        }
+    }
+    for (const auto& error : errors)
+        std::cerr << error << '\n';
+    return errors.empty() ? 0 : 1;
+}
+
+static int audio_info(const vector<string>& files)
+{
+    auto start = std::chrono::steady_clock::now();
+    int header_hits = 0;
+    vector<string> errors;
+    for (const auto& file : files)
+    {
+        // only the audio is read, so a file without tags is no obstacle
+        MpegInfo info;
+        try
+        {
+            info = scan_mpeg(file, audio_payload(file).begin);
+        }
+        catch (const std::exception& e)
+        {
+            errors.push_back(file + ": " + e.what());
+            continue;
+        }
+        if (!info.valid)
+        {
+            std::cout << file << "\tno MPEG audio found\n";
+            continue;
+        }
+        header_hits += info.from_header;
+        std::cout << file << '\t' << info.duration << " s\t"
+                  << info.bitrate << " kbps\t" << info.sample_rate << " Hz\t"
+                  << (info.vbr ? "VBR" : "CBR") << '\n';
+    }
+    // timing goes to stderr so it stays out of report output
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    std::cerr << files.size() << " files in " << took.count() << " s, "
+              << header_hits << " from Xing/Info/VBRI headers\n";
+    for (const auto& error : errors)
+        std::cerr << error << '\n';
+    return errors.empty() ? 0 : 1;
+}
+
+static int mp4_layouts(const vector<string>& files)
+{
+    // typical edits: a changed title, a handful of new tags, new cover art
+    const intmax_t deltas[] = { 16, 256, 4096, 65536 };
+    size_t hits[4]{};
+    size_t scanned = 0;
+    for (const auto& file : files)
+    {
+        Mp4Layout layout;
+        try
+        {
+            layout = mp4_layout(file);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << file << ": " << e.what() << '\n';
+            continue;
+        }
+        ++scanned;
+        std::cout << file << "\tmoov " << (layout.moov_last ? "last" : "first")
+                  << '\t' << layout.moov_size << "\tilst " << layout.ilst_size
+                  << "\tilst free " << layout.ilst_free << "\tmoov free "
+                  << layout.moov_free << '\n';
+        for (int i = 0; i != 4; ++i)
+            hits[i] += mp4_fits_in_place(layout, deltas[i]);
+    }
+    // the summary goes to stderr so it stays out of report output
+    for (int i = 0; i != 4; ++i)
+        std::cerr << "+" << deltas[i] << " bytes: " << hits[i] << " of "
+                  << scanned << " in place\n";
+    return 0;
+}
+
+// load every audio file under dir into index, skipping unreadable ones
+static void build_index(TagIndex& index, const string& dir)
+{
+    // stamped before the read, so a file changed during it looks stale
+    // to the watcher rather than current
+    vector<string> paths = list_audio_files(dir);
+    std::map<string, FileStamp> stamped;
+    for (const auto& path : paths)
+        stamped[path] = FileStamp::of(path);
+    
+    vector<string> errors;
+    vector<std::pair<string, TagMap>> batch;
+    vector<FileStamp> stamps;
+    for (auto& row : load_tags(paths, &errors))
+    {
+        stamps.push_back(stamped[row.path]);
+        batch.push_back({ std::move(row.path), std::move(row.tags) });
+    }
+    for (const auto& error : errors)
+        std::cerr << error << '\n';
+    index.update_batch(batch, stamps);
+}
+
+static int query(const string& dir, const vector<string>& terms)
+{
+    if (terms.empty() || terms.size() % 3 != 0)
+        return usage();
+    TagIndex index;
+    build_index(index, dir);
+    
+    auto start = std::chrono::steady_clock::now();
+    vector<TagIndex::TrackId> hits;
+    for (size_t i = 0; i != terms.size(); i += 3)
+    {
+        vector<TagIndex::TrackId> matched;
+        try
+        {
+            matched = index.match(terms[i], terms[i + 1], terms[i + 2]);
+        }
+        catch (const std::invalid_argument&)
+        {
+            return usage();
+        }
+        hits = i == 0 ? matched : TagIndex::intersect(hits, matched);
+    }
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    
+    for (auto id : hits)
+        std::cout << index.path(id) << '\n';
+    std::cerr << hits.size() << " of " << index.size() << " tracks in "
+              << took.count() * 1000 << " ms\n";
+    return 0;
+}
+
+static int export_tags(const string& dir, const string& file)
+{
+    // rows are written out a group at a time as the files are read
+    vector<string> errors;
+    size_t exported = 0;
+    TagWriter out(file);
+    stream_tags(list_audio_files(dir), [&] (vector<TagRow>& rows)
+    {
+        out.write(rows);
+        exported += rows.size();
+    }, &errors);
+    out.finish();
+    for (const auto& error : errors)
+        std::cerr << error << '\n';
+    std::cerr << exported << " files exported\n";
+    return errors.empty() ? 0 : 1;
+}
+
+static int view_tags(const string& in, const string& out)
+{
+    ColumnarReader reader(in);
+    TagWriter writer(out);
+    vector<TagRow> rows;
+    while (reader.next(rows))
+        writer.write(rows);
+    writer.finish();
+    return 0;
+}
+
+static int import(const string& file)
+{
+    vector<TagRow> rows = read_columnar(file);
+    if (shard.count != 0)
+        rows.erase(std::remove_if(rows.begin(), rows.end(), [] (const TagRow& row)
+                   { return shard_of(row.path, shard.count) != shard.index; }),
+                   rows.end());
+    ImportStats stats = import_tags(rows, false, journal.get(), checkpoint);
+    print_errors(stats.errors);
+    tally("files written", stats.files_written);
+    tally("tags changed", stats.tags_changed);
+    tally("files unchanged", stats.files_unchanged);
+    tally("files done by an earlier run", stats.files_resumed);
+    std::cerr << stats.files_written << " files written ("
+              << stats.tags_changed << " tags), " << stats.files_unchanged
+              << " unchanged";
+    if (stats.files_resumed != 0)
+        std::cerr << ", " << stats.files_resumed << " done by an earlier run";
+    std::cerr << '\n';
+    return stats.errors.empty() ? 0 : 1;
+}
+
+static int run_rules(const string& rulefile, const string& dir, bool dry_run)
+{
+    std::ifstream in(rulefile);
+    if (!in)
+        throw std::runtime_error("Unable to open " + rulefile);
+    std::stringstream text;
+    text << in.rdbuf();
+    RuleSet rules = RuleSet::compile(text.str());
+    
+    // files a checkpointed earlier run finished aren't even loaded
+    vector<string> errors;
+    vector<string> paths = list_audio_files(dir);
+    paths = in_shard(paths, shard);
+    vector<string> todo = unfinished(paths, checkpoint);
+    if (todo.size() != paths.size())
+        std::cerr << paths.size() - todo.size() << " files done by an earlier run\n";
+    tally("files done by an earlier run", paths.size() - todo.size());
+    auto rows = load_tags(todo, &errors);
+    auto dirty = rules.apply_all(rows);
+    
+    vector<TagRow> changed;
+    for (auto i : dirty)
+    {
+        std::cout << rows[i].path << '\n';
+        changed.push_back(std::move(rows[i]));
+    }
+    std::cerr << changed.size() << " of " << rows.size() << " files changed by "
+              << rules.size() << " rules\n";
+    tally("files loaded", rows.size());
+    tally("files changed by rules", changed.size());
+    if (!dry_run)
+    {
+        ImportStats stats = import_tags(changed, true, journal.get(),
+                                        checkpoint);
+        errors.insert(errors.end(), stats.errors.begin(), stats.errors.end());
+        tally("files written", stats.files_written);
+        tally("files done by an earlier run", stats.files_resumed);
+        std::cerr << stats.files_written << " files written";
+        if (stats.files_resumed != 0)
+            std::cerr << ", " << stats.files_resumed << " done by an earlier run";
+        std::cerr << '\n';
+    }
+    print_errors(errors);
+    return errors.empty() ? 0 : 1;
+}
+
+static int revert(const string& file, const vector<string>& batch)
+{
+    uint64_t which = batch.empty() ? last_batch(file) : std::stoull(batch[0]);
+    RevertStats stats = revert_batch(file, which);
+    for (const auto& error : stats.errors)
+        std::cerr << error << '\n';
+    std::cerr << stats.files << " files reverted to before batch " << which << '\n';
+    return stats.errors.empty() ? 0 : 1;
+}
+
+// runs the command line, less --shards, as count workers and reports
+// what they did between them: their stdout in shard order, then the
+// errors and the summed counts on stderr
+static int coordinate(const vector<string>& worker, unsigned count,
+                      const string& dir)
+{
+    ShardRun run = run_shards(worker, count, dir);
+    for (unsigned k = 0; k != count; ++k)
+    {
+        std::ifstream out(shard_file(dir, k, "out"));
+        if (out && out.peek() != std::ifstream::traits_type::eof())
+            std::cout << out.rdbuf();
+    }
+    std::cout.flush();
+    for (const auto& error : run.merged.errors)
+        std::cerr << error << '\n';
+    for (const auto& count : run.merged.counts)
+        std::cerr << count.second << ' ' << count.first << '\n';
+    std::cerr << run.ran.size() << " shards run, " << run.reused.size()
+              << " done by an earlier run\n";
+    for (auto k : run.failed)
+        std::cerr << "shard " << k << " failed, see " << shard_file(dir, k, "log")
+                  << "; rerun to retry it\n";
+    return run.failed.empty() && run.merged.errors.empty() ? 0 : 1;
+}
+
+static std::atomic<bool> stop_requested{false};
+
+static int watch(const string& dir)
+{
+    TagIndex index;
+    build_index(index, dir);
+    std::cerr << "watching " << dir << ", " << index.size() << " tracks\n";
+    
+    std::signal(SIGINT, [] (int) { stop_requested = true; });
+    std::signal(SIGTERM, [] (int) { stop_requested = true; });
+    watch_folder(dir, index, stop_requested, [&index] (const WatchFlush& done)
+        {
+            std::cerr << "indexed " << done.indexed << ", removed "
+                      << done.removed << ", unreadable " << done.failed
+                      << ", " << index.size() << " tracks\n";
+        });
+    return 0;
+}
+
+static int serve(const string& socket_path, const string& dir)
+{
+    // queries answer from dir's index, kept current by a watcher
+    TagIndex index;
+    std::thread watcher;
+    if (!dir.empty())
+    {
+        build_index(index, dir);
+        watcher = std::thread([&] {
+            try
+            {
+                watch_folder(dir, index, stop_requested);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ", index won't follow changes\n";
+            }
+        });
+    }
+    std::cerr << "serving " << socket_path << ", " << index.size()
+              << " tracks\n";
+    
+    std::signal(SIGINT, [] (int) { stop_requested = true; });
+    std::signal(SIGTERM, [] (int) { stop_requested = true; });
+    try
+    {
+        serve_tags(socket_path, index, stop_requested, journal.get(), 0,
+                   cache_budget);
+    }
+    catch (...)
+    {
+        stop_requested = true;
+        if (watcher.joinable())
+            watcher.join();
+        throw;
+    }
+    if (watcher.joinable())
+        watcher.join();
+    return 0;
+}
+
+static int dispatch(const string& command, const vector<string>& args)
+{
+    if (command == "--extract-art" && args.size() >= 2)
+        return extract_art(args[0], vector<string>(args.begin() + 1,
+                                                   args.end()));
+    else if (command == "--strip-art" && !args.empty())
+        return strip_art(args);
+    else if (command == "--hash" && !args.empty())
+        return hash_files(args);
+    else if (command == "--duplicates" && !args.empty())
+        return find_duplicates(args);
+    else if (command == "--audio-info" && !args.empty())
+        return audio_info(args);
+    else if (command == "--mp4-layout" && !args.empty())
+        return mp4_layouts(args);
+    else if (command == "--serve" && (args.size() == 1 || args.size() == 2))
+        return serve(args[0], args.size() == 2 ? args[1] : "");
+    else if (command == "--query" && args.size() >= 4)
+        return query(args[0], vector<string>(args.begin() + 1, args.end()));
+    else if (command == "--watch" && args.size() == 1)
+        return watch(args[0]);
+    else if (command == "--export" && args.size() == 2)
+        return export_tags(args[0], args[1]);
+    else if (command == "--view" && args.size() == 2)
+        return view_tags(args[0], args[1]);
+    else if (command == "--import" && args.size() == 1)
+        return import(args[0]);
+    else if (command == "--rules" && (args.size() == 2 ||
+             (args.size() == 3 && args[2] == "--dry-run")))
+        return run_rules(args[0], args[1], args.size() == 3);
+    else if (command == "--revert" && (args.size() == 1 || args.size() == 2))
+        return revert(args[0], vector<string>(args.begin() + 1, args.end()));
+    else if (command.rfind("--memory-budget=", 0) == 0)
+        return -1;  // a GUI option, handled in main
+    return usage();
+}
+
+int run_cli(int argc, char* argv[])
+{
+    if (argc < 2 || string(argv[1]).rfind("--", 0) != 0)
+        return -1;
+    string command = argv[1];
+    vector<string> args;
+    string journal_file;
+    string shard_dir;
+    string shards;
+    string worker_shard;
+    // a worker is started with the coordinator's own arguments
+    vector<string> worker{ self_path(argv[0]) };
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg.rfind("--shards=", 0) == 0)
+            shards = arg.substr(9);
+        else if (arg.rfind("--shard-dir=", 0) != 0)
+            worker.push_back(arg);
+        if (i == 1)
+            continue;
+        if (arg.rfind("--journal=", 0) == 0)
+            journal_file = arg.substr(10);
+        else if (arg.rfind("--checkpoint=", 0) == 0)
+            checkpoint = arg.substr(13);
+        else if (arg.rfind("--shard-dir=", 0) == 0)
+            shard_dir = arg.substr(12);
+        else if (arg.rfind("--shard-worker=", 0) == 0)
+            worker_shard = arg.substr(15);
+        else if (arg.rfind("--memory-budget=", 0) == 0)
+            cache_budget = std::stoull(arg.substr(16)) << 20;
+        else if (arg.rfind("--shards=", 0) != 0)
+            args.push_back(arg);
+    }
+    bool shardable = command == "--strip-art" || command == "--import" ||
+                     command == "--rules";
+    
+    try
+    {
+        if (!shards.empty() || !worker_shard.empty())
+        {
+            if (!shardable || shard_dir.empty() ||
+                (!shards.empty() && !worker_shard.empty()))
+                return usage();
+            if (!shards.empty())
+            {
+                unsigned count = static_cast<unsigned>(std::stoul(shards));
+                if (count == 0)
+                    return usage();
+                return coordinate(worker, count, shard_dir);
+            }
+            // each shard keeps its own checkpoint and journal, so
+            // concurrent workers never append to the same file
+            shard = parse_shard(worker_shard);
+            checkpoint = shard_file(shard_dir, shard.index, "checkpoint");
+            if (!journal_file.empty())
+                journal_file += "." + std::to_string(shard.index);
+        }
+        if (!journal_file.empty())
+            journal = std::make_unique<TagJournal>(journal_file);
+        int status = dispatch(command, args);
+        // a worker that got through its list leaves its result, whether
+        // or not every file in it went well; the next run relaunches a
+        // shard whose result lists errors
+        if (shard.count != 0 && (status == 0 || status == 1))
+            write_shard_result(shard_file(shard_dir, shard.index, "result"),
+                               shard_result);
+        return status;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
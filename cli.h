@@ -0,0 +1,10 @@
+#ifndef CLI_H
+#define CLI_H
+
+// runs a batch command given on the command line, e.g.
+//   --extract-art <outdir> <files...>
+// returns the process exit status, or -1 when argv holds no batch
+// command and the GUI should start instead
+int run_cli(int argc, char* argv[]);
+
+#endif // CLI_H
@@ -0,0 +1,507 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <list>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <stdexcept>
+#include <filesystem>
+#include "daemon.h"
+#include "tagindex.h"
+#include "journal.h"
+#include "audiofile.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+typedef unsigned char byte;
+using std::string;
+using std::vector;
+namespace fs = std::filesystem;
+
+#if defined(__unix__) || defined(__APPLE__)
+
+namespace {
+
+// anything bigger is a confused client, not a tag edit
+const uint32_t max_frame = 64 << 20;
+
+// how long a worker waits on a client that stops halfway through a frame
+// (or stops reading its response) before dropping it
+const int client_timeout_s = 5;
+
+class Reader
+{
+public:
+    explicit Reader(const vector<byte>& buf)
+        : pos(buf.data()), end(buf.data() + buf.size()) { }
+
+    byte u8()
+    {
+        need(1);
+        return *pos++;
+    }
+
+    uint32_t u32()
+    {
+        need(4);
+        uint32_t v = pos[0] | pos[1] << 8 | pos[2] << 16 | uint32_t(pos[3]) << 24;
+        pos += 4;
+        return v;
+    }
+
+    string str()
+    {
+        uint32_t n = u32();
+        need(n);
+        string s(reinterpret_cast<const char*>(pos), n);
+        pos += n;
+        return s;
+    }
+
+private:
+    const byte* pos;
+    const byte* end;
+
+    void need(size_t n)
+    {
+        if (static_cast<size_t>(end - pos) < n)
+            throw std::runtime_error("Malformed request");
+    }
+};
+
+void put_u32(vector<byte>& out, uint32_t v)
+{
+    for (int i = 0; i != 4; ++i)
+        out.push_back((v >> (8 * i)) & 255);
+}
+
+void put_str(vector<byte>& out, std::string_view s)
+{
+    put_u32(out, static_cast<uint32_t>(s.size()));
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+bool read_full(int fd, byte* data, size_t n)
+{
+    while (n != 0)
+    {
+        ssize_t got = read(fd, data, n);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data += got;
+        n -= got;
+    }
+    return true;
+}
+
+bool write_full(int fd, const byte* data, size_t n)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;  // a vanished client isn't fatal
+#else
+    const int flags = 0;
+#endif
+    while (n != 0)
+    {
+        ssize_t sent = send(fd, data, n, flags);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        data += sent;
+        n -= sent;
+    }
+    return true;
+}
+
+class Server
+{
+public:
+    Server(TagIndex& index, TagJournal* journal, size_t cache_budget)
+        : index(index), journal(journal), cache_budget(cache_budget) { }
+
+    // one request from fd, false once the client has gone; the buffers
+    // belong to the worker and keep their capacity between requests
+    bool serve_request(int fd, vector<byte>& request, vector<byte>& response)
+    {
+        byte head[4];
+        if (!read_full(fd, head, 4))
+            return false;
+        uint32_t len = head[0] | head[1] << 8 | head[2] << 16 |
+                       uint32_t(head[3]) << 24;
+        if (len > max_frame)
+            return false;
+        request.resize(len);
+        if (!read_full(fd, request.data(), len))
+            return false;
+        handle(request, response);
+        return write_full(fd, response.data(), response.size());
+    }
+
+private:
+    struct Cached
+    {
+        uintmax_t size;
+        fs::file_time_type mtime;
+        TagMap tags;
+        size_t bytes = 0;  // roughly what the entry holds in memory
+        std::list<string>::iterator use;
+    };
+
+    TagIndex& index;
+    TagJournal* journal;
+    // parsed tags by path, least recently used evicted first once the
+    // entries add up to more than cache_budget bytes
+    std::mutex cache_mutex;
+    std::unordered_map<string, Cached> cache;
+    std::list<string> cache_uses;  // most recent first
+    size_t cache_budget;
+    size_t cache_bytes = 0;
+    std::mutex journal_mutex;
+    // one writer or parser per file at a time, without a lock per file
+    std::mutex file_mutexes[64];
+
+    std::mutex& file_mutex(const string& path)
+    {
+        return file_mutexes[std::hash<string>()(path) % 64];
+    }
+
+    // with cache_mutex held
+    void remember(const string& path, Cached fresh)
+    {
+        fresh.bytes = 2 * path.size() + 128;
+        for (const auto& tag : fresh.tags)
+            fresh.bytes += tag.first.size() + tag.second.size() + 64;
+        auto it = cache.find(path);
+        if (it != cache.end())
+        {
+            cache_bytes -= it->second.bytes;
+            cache_uses.erase(it->second.use);
+            cache.erase(it);
+        }
+        if (fresh.bytes > cache_budget)
+            return;
+        cache_uses.push_front(path);
+        fresh.use = cache_uses.begin();
+        cache_bytes += fresh.bytes;
+        cache.insert({ path, std::move(fresh) });
+        while (cache_bytes > cache_budget)
+        {
+            auto oldest = cache.find(cache_uses.back());
+            cache_bytes -= oldest->second.bytes;
+            cache.erase(oldest);
+            cache_uses.pop_back();
+        }
+    }
+
+    TagMap read_tags(const string& path)
+    {
+        uintmax_t size = fs::file_size(path);
+        fs::file_time_type mtime = fs::last_write_time(path);
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto it = cache.find(path);
+            if (it != cache.end() && it->second.size == size &&
+                it->second.mtime == mtime)
+            {
+                cache_uses.splice(cache_uses.begin(), cache_uses, it->second.use);
+                return it->second.tags;
+            }
+        }
+        std::lock_guard<std::mutex> file_lock(file_mutex(path));
+        std::unique_ptr<AudioFile> audio(open_audio_file(path));
+        TagMap tags = audio->get_qtags();
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        remember(path, Cached{ size, mtime, tags });
+        return tags;
+    }
+
+    void write_tags(const string& path, const TagMap& changes)
+    {
+        std::lock_guard<std::mutex> file_lock(file_mutex(path));
+        std::unique_ptr<AudioFile> audio(open_audio_file(path));
+        TagMap& tags = audio->get_qtags();
+        bool changed = false;
+        for (const auto& tag : changes)
+        {
+            auto it = tags.find(tag.first);
+            if (it != tags.end() && it->second == tag.second)
+                continue;
+            tags[tag.first] = tag.second;
+            changed = true;
+        }
+        if (!changed)
+            return;
+        if (journal)
+        {
+            std::lock_guard<std::mutex> lock(journal_mutex);
+            journal->record(path);
+        }
+        audio->set_in_place(true);
+        if (!audio->write_qtags())
+            throw std::runtime_error("Unable to write " + path);
+        index.update(path, tags, FileStamp::of(path));
+
+        Cached fresh{ fs::file_size(path), fs::last_write_time(path), tags };
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        remember(path, std::move(fresh));
+    }
+
+    void handle(const vector<byte>& request, vector<byte>& response)
+    {
+        response.assign(5, 0);  // length, then status ok
+        try
+        {
+            Reader in(request);
+            byte op = in.u8();
+            if (op == 'R')
+            {
+                TagMap tags = read_tags(in.str());
+                put_u32(response, static_cast<uint32_t>(tags.size()));
+                for (const auto& tag : tags)
+                {
+                    put_str(response, tag.first);
+                    put_str(response, tag.second);
+                }
+            }
+            else if (op == 'W')
+            {
+                string path = in.str();
+                TagMap tags;
+                for (uint32_t n = in.u32(); n != 0; --n)
+                {
+                    string key = in.str();
+                    tags[key] = in.str();
+                }
+                write_tags(path, tags);
+            }
+            else if (op == 'Q')
+            {
+                vector<TagIndex::TrackId> hits;
+                uint32_t n = in.u32();
+                for (uint32_t i = 0; i != n; ++i)
+                {
+                    string key = in.str();
+                    string match_op = in.str();
+                    auto matched = index.match(key, match_op, in.str());
+                    hits = i == 0 ? matched : TagIndex::intersect(hits, matched);
+                }
+                put_u32(response, static_cast<uint32_t>(hits.size()));
+                for (auto id : hits)
+                    put_str(response, index.path(id));
+            }
+            else
+                throw std::runtime_error("Unknown request " + std::to_string(op));
+        }
+        catch (const std::exception& e)
+        {
+            response.assign(5, 0);
+            response[4] = 1;
+            put_str(response, e.what());
+        }
+        uint32_t len = static_cast<uint32_t>(response.size() - 4);
+        for (int i = 0; i != 4; ++i)
+            response[i] = (len >> (8 * i)) & 255;
+    }
+};
+
+// both ends non-blocking and close-on-exec, so a burst of wakes can
+// neither block a worker nor leave the loop stuck draining
+bool make_wake_pipe(int fds[2])
+{
+#ifdef __APPLE__
+    if (pipe(fds) != 0)
+        return false;
+    for (int i = 0; i != 2; ++i)
+        if (fcntl(fds[i], F_SETFL, O_NONBLOCK) != 0 ||
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC) != 0)
+            return false;
+    return true;
+#else
+    return pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0;
+#endif
+}
+
+// clears away a socket an earlier run left at addr. one another server
+// still answers on is left alone, and so is anything that isn't a socket
+void clear_stale_socket(const sockaddr_un& addr, const string& socket_path)
+{
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) != 0)
+        return;
+    if (!S_ISSOCK(st.st_mode))
+        throw std::runtime_error(socket_path + " exists and is not a socket");
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0)
+        throw std::runtime_error("Unable to create socket");
+    bool live = connect(probe, reinterpret_cast<const sockaddr*>(&addr),
+                        sizeof addr) == 0;
+    close(probe);
+    if (live)
+        throw std::runtime_error("Already being served: " + socket_path);
+    unlink(socket_path.c_str());
+}
+
+}
+
+void serve_tags(const string& socket_path, TagIndex& index,
+                const std::atomic<bool>& stop, TagJournal* journal,
+                unsigned threads, size_t cache_budget)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof addr.sun_path)
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    socket_path.copy(addr.sun_path, socket_path.size());
+
+    clear_stale_socket(addr, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        throw std::runtime_error("Unable to create socket");
+    // the socket gets its mode before listen, so no one else can
+    // connect in between; writes go to the owner's files alone
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 ||
+        chmod(socket_path.c_str(), 0600) != 0 || listen(listener, 64) != 0)
+    {
+        close(listener);
+        throw std::runtime_error("Unable to listen on " + socket_path);
+    }
+
+    // idle connections wait in poll here; a readable one goes to a worker
+    // for a single request and comes back through returned, with a byte
+    // down the wake pipe, so idle clients never tie up a worker
+    int wake[2];
+    if (!make_wake_pipe(wake))
+    {
+        close(listener);
+        unlink(socket_path.c_str());
+        throw std::runtime_error("Unable to create pipe");
+    }
+    Server server(index, journal, cache_budget);
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<int> pending;
+    vector<int> returned;
+
+    vector<std::thread> pool;
+    for (unsigned i = 0; i != threads; ++i)
+        pool.emplace_back([&] {
+            vector<byte> request, response;
+            while (true)
+            {
+                int fd;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_ready.wait(lock, [&] { return stop || !pending.empty(); });
+                    if (stop)
+                        return;
+                    fd = pending.front();
+                    pending.pop_front();
+                }
+                if (!server.serve_request(fd, request, response))
+                {
+                    close(fd);
+                    continue;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    returned.push_back(fd);
+                }
+                byte b = 0;
+                if (write(wake[1], &b, 1) < 0) { }  // a full pipe wakes too
+            }
+        });
+
+    vector<int> idle;
+    vector<pollfd> polled;
+    while (!stop)
+    {
+        polled.assign({ { listener, POLLIN, 0 }, { wake[0], POLLIN, 0 } });
+        for (int fd : idle)
+            polled.push_back({ fd, POLLIN, 0 });
+        if (poll(polled.data(), polled.size(), 200) <= 0)
+            continue;
+
+        vector<int> still_idle;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            for (size_t i = 2; i != polled.size(); ++i)
+                if (polled[i].revents != 0)
+                    pending.push_back(polled[i].fd);  // data or hang-up
+                else
+                    still_idle.push_back(polled[i].fd);
+            if (polled[1].revents != 0)
+            {
+                byte drain[256];
+                while (read(wake[0], drain, sizeof drain) > 0)
+                    ;  // until EAGAIN
+                still_idle.insert(still_idle.end(), returned.begin(),
+                                  returned.end());
+                returned.clear();
+            }
+        }
+        queue_ready.notify_all();
+        idle.swap(still_idle);
+        if (polled[0].revents != 0)
+        {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                // a client that stalls mid-frame times out instead of
+                // holding a worker; between requests it waits in poll
+                timeval limit{ client_timeout_s, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof limit);
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof limit);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                idle.push_back(fd);
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue_ready.notify_all();
+    }
+    for (auto& t : pool)
+        t.join();
+    for (const auto* fds : { &idle, &returned })
+        for (int fd : *fds)
+            close(fd);
+    for (int fd : pending)
+        close(fd);
+    close(wake[0]);
+    close(wake[1]);
+    close(listener);
+    unlink(socket_path.c_str());
+}
+
+#else
+
+void serve_tags(const string&, TagIndex&, const std::atomic<bool>&,
+                TagJournal*, unsigned, size_t)
+{
+    throw std::runtime_error("Unix domain sockets not available on this platform");
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+#include <atomic>
+#include <cstddef>
+
+class TagIndex;
+class TagJournal;
+
+// serves tag requests on a Unix domain socket until stop is set, so a
+// caller pays a round trip instead of process startup and a cold parse.
+// a connection may carry any number of requests; idle connections are
+// polled and each request goes to one of threads workers (0 = one per core).
+//
+// every frame is a u32 length of the rest, then the rest; integers are
+// little-endian and a str is a u32 length followed by UTF-8 bytes
+//
+//   request   u8 op, then
+//     'R'  read   str path
+//     'W'  write  str path, u32 n, n x (str key, str value)
+//     'Q'  query  u32 n, n x (str key, str op, str value), op as --query
+//   response  u8 status, then
+//     0 ok    R: u32 n, n x (str key, str value)   W: nothing
+//             Q: u32 n, n x str path
+//     1 error str message
+//
+// the socket is made 0600, so only its owner can connect, and a socket
+// path another server still answers on is refused rather than replaced.
+// a client that stalls partway through a frame is dropped after a few
+// seconds. writes edit the file in place and keep index in step; with a journal
+// they're recorded there first for --revert. parsed tags stay cached
+// until the file's size or modification time changes, or until the
+// cache passes cache_budget bytes and they are the least recently used
+void serve_tags(const std::string& socket_path, TagIndex& index,
+                const std::atomic<bool>& stop, TagJournal* journal = nullptr,
+                unsigned threads = 0, size_t cache_budget = size_t(64) << 20);
+
+#endif // DAEMON_H
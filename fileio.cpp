@@ -0,0 +1,182 @@
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include <filesystem>
+#include "fileio.h"
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+#ifdef _WIN32
+
+void clone_file(const string& from, const string& to)
+{
+    fs::copy(from, to);
+}
+
+vector<unsigned char> read_at(const string& path, uintmax_t offset, size_t n)
+{
+    std::ifstream in(path, std::ios_base::binary);
+    if (!in)
+        throw std::runtime_error("Unable to open " + path);
+    vector<unsigned char> ret(n);
+    in.seekg(offset);
+    in.read(reinterpret_cast<char*>(ret.data()), n);
+    ret.resize(in.gcount());
+    return ret;
+}
+
+void write_at(const string& path, uintmax_t offset,
+              const unsigned char* data, size_t n)
+{
+    std::fstream out(path, std::ios_base::binary | std::ios_base::in
+                           | std::ios_base::out);
+    out.seekp(offset);
+    if (!out.write(reinterpret_cast<const char*>(data), n))
+        throw std::runtime_error("Unable to write " + path);
+}
+
+void sync_path(const string&)
+{
+}
+
+#else
+
+void clone_file(const string& from, const string& to)
+{
+#ifdef FICLONE
+    int in = ::open(from.c_str(), O_RDONLY);
+    if (in >= 0)
+    {
+        struct stat st;
+        int out = ::fstat(in, &st) == 0
+            ? ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777)
+            : -1;
+        bool cloned = out >= 0 && ::ioctl(out, FICLONE, in) == 0;
+        if (out >= 0)
+            ::close(out);
+        ::close(in);
+        if (cloned)
+            return;
+        if (out >= 0)  // no reflinks here, or not across these two files
+            ::unlink(to.c_str());
+    }
+#endif
+    fs::copy(from, to);
+}
+
+vector<unsigned char> read_at(const string& path, uintmax_t offset, size_t n)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Unable to open " + path);
+    vector<unsigned char> ret(n);
+    ssize_t got = ::pread(fd, ret.data(), n, static_cast<off_t>(offset));
+    ::close(fd);
+    ret.resize(got < 0 ? 0 : got);
+    return ret;
+}
+
+void write_at(const string& path, uintmax_t offset,
+              const unsigned char* data, size_t n)
+{
+    int fd = ::open(path.c_str(), O_WRONLY);
+    if (fd < 0)
+        throw std::runtime_error("Unable to open " + path);
+    ssize_t put = ::pwrite(fd, data, n, static_cast<off_t>(offset));
+    ::close(fd);
+    if (put != static_cast<ssize_t>(n))
+        throw std::runtime_error("Unable to write " + path);
+}
+
+void sync_path(const string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Unable to open " + path);
+    int synced = ::fsync(fd);
+    ::close(fd);
+    if (synced != 0)
+        throw std::runtime_error("Unable to sync " + path);
+}
+
+#endif
+
+FilePrefix read_prefix(const string& path)
+{
+    FilePrefix ret;
+    ret.bytes = read_at(path, 0, file_prefix_size);
+    ret.whole = ret.bytes.size() < file_prefix_size;
+    return ret;
+}
+
+vector<unsigned char> read_at(const FilePrefix& prefix, const string& path,
+                              uintmax_t offset, size_t n)
+{
+    const auto& bytes = prefix.bytes;
+    if (offset <= bytes.size() && (n <= bytes.size() - offset || prefix.whole))
+    {
+        auto first = bytes.begin() + offset;
+        return vector<unsigned char>(first, first + std::min<uintmax_t>(
+                                                n, bytes.size() - offset));
+    }
+    return read_at(path, offset, n);
+}
+
+PrefixedFile::PrefixedFile(const string& path, FilePrefix prefix)
+    : std::istream(nullptr), buf(path, std::move(prefix))
+{
+    rdbuf(&buf);
+}
+
+PrefixedFile::Buf::Buf(const string& path, FilePrefix prefix)
+    : path(path), prefix(std::move(prefix))
+{
+    char* first = reinterpret_cast<char*>(this->prefix.bytes.data());
+    setg(first, first, first + this->prefix.bytes.size());
+}
+
+PrefixedFile::Buf::int_type PrefixedFile::Buf::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    base += egptr() - eback();
+    setg(egptr(), egptr(), egptr());
+    if (!file.is_open())
+    {
+        if (prefix.whole ||
+            !file.open(path, std::ios_base::in | std::ios_base::binary))
+            return traits_type::eof();
+        setg(nullptr, nullptr, nullptr);
+        vector<unsigned char>().swap(prefix.bytes);
+        if (file.pubseekpos(base) == pos_type(off_type(-1)))
+            return traits_type::eof();
+    }
+    chunk.resize(file_prefix_size);
+    std::streamsize got = file.sgetn(chunk.data(), chunk.size());
+    setg(chunk.data(), chunk.data(), chunk.data() + std::max<std::streamsize>(got, 0));
+    return got > 0 ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+}
+
+PrefixedFile::Buf::pos_type PrefixedFile::Buf::seekoff(
+    off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::in))
+        return pos_type(off_type(-1));
+    return pos_type(off_type(base + (gptr() - eback())));
+}
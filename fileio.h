@@ -0,0 +1,69 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+// single positioned read/write (pread/pwrite where available), for the
+// small fixed-offset pieces of a file we care about
+std::vector<unsigned char> read_at(const std::string& path, uintmax_t offset,
+                                   size_t n);
+void write_at(const std::string& path, uintmax_t offset,
+              const unsigned char* data, size_t n);
+
+// fsync the file or directory at path: what was written to it through
+// any stream is on disk once this returns, and for a directory so are
+// the names just created in it. does nothing on Windows
+void sync_path(const std::string& path);
+
+// copies from to the new file to. where the filesystem can share extents
+// (a FICLONE reflink on btrfs, XFS and the like) no data is copied at all;
+// elsewhere it falls back to an ordinary copy
+void clone_file(const std::string& from, const std::string& to);
+
+// the first bytes of a file, read once to tell its format and then handed
+// on to the parser so they aren't read again
+struct FilePrefix
+{
+    std::vector<unsigned char> bytes;
+    bool whole = false;  // the file ends within bytes
+};
+
+const size_t file_prefix_size = 65536;
+FilePrefix read_prefix(const std::string& path);
+
+// read_at, answered from prefix when it covers the range
+std::vector<unsigned char> read_at(const FilePrefix& prefix,
+                                   const std::string& path, uintmax_t offset,
+                                   size_t n);
+
+// an istream over path that serves prefix first and opens the file only
+// once a read runs past it. tellg works, seeking doesn't
+class PrefixedFile : public std::istream
+{
+public:
+    PrefixedFile(const std::string& path, FilePrefix prefix);
+private:
+    class Buf : public std::streambuf
+    {
+    public:
+        Buf(const std::string& path, FilePrefix prefix);
+    protected:
+        int_type underflow() override;
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                         std::ios_base::openmode which) override;
+    private:
+        std::string path;
+        FilePrefix prefix;
+        std::filebuf file;
+        std::vector<char> chunk;
+        uintmax_t base = 0;  // file offset of eback()
+    };
+    Buf buf;
+};
+
+#endif // FILEIO_H
@@ -1,15 +1,16 @@
 #include <vector>
 #include <deque>
-#include <map>
 #include <fstream>
 #include <ios>
 #include <iterator>
 #include <algorithm>
 #include <filesystem>
-#include <QDebug>
-#include <QString>
 #include <string>
+#include <cctype>
+#include <utility>
 #include "flacfile.h"
+#include "vcomment.h"
+#include "fileio.h"
 
 
 using std::vector; 
@@ -25,276 +26,220 @@ vector<byte> make_3be(size_t sz)
     return ret;
 }
 
-vector<byte> make_4le(size_t sz)
+// the first block of type, nullptr if there is none
+template <typename Blocks>
+static auto find_block(Blocks& blocks, byte type) -> decltype(&blocks[0])
 {
-    vector<byte> ret;
-    ret.push_back(sz & 255);
-    ret.push_back((sz >> 8) & 255);
-    ret.push_back((sz >> 16) & 255);
-    ret.push_back(static_cast<byte>(sz >> 24));
-    
-    return ret;
+    for (auto& block : blocks)
+        if (block.first == type)
+            return &block;
+    return nullptr;
 }
 
-int get_4le_advance(std::vector<byte>::iterator& it)
+FlacFile::Blocks FlacFile::make_blocks()
 {
-    int ret =  (*it) | (*(it + 1)) << 8 | (*(it + 2)) << 16 | (*(it + 3)) << 24;
-    it += 4;
-    return ret;
-}
-
-std::map<byte, vector<byte>> FlacFile::make_blocks()
-{
-    std::ifstream mediafile(filename.toStdString(), std::ios_base::binary);
+    PrefixedFile mediafile(filename, std::exchange(prefix, FilePrefix()));
     noskipws(mediafile);
     std::istream_iterator<byte> infile(mediafile);
+    // every size is checked against the file first, since the iterator
+    // can't be read past the end
+    auto fsize = fs::file_size(fs::path(filename));
+    if (fsize < 42)
+        throw std::runtime_error("Truncated FLAC header in " + filename);
+    header.clear();  // may be reloading after drop_buffers
     header.reserve(42);
     copy_n(infile, 42, std::back_inserter(header));
     ++infile;
     
-    std::map<byte, vector<byte>> metablocks;
+    Blocks metablocks;
+    uintmax_t pos = 42;
     while (1)
     {
+        if (fsize - pos < 4)
+            throw std::runtime_error("Truncated FLAC metadata in " + filename);
         byte blockinfo[4]{};
         copy_n(infile, 4, blockinfo);
         ++infile;
         bool lastblock = blockinfo[0] >> 7;  // set bit here indicates final block
         byte blockbyte = blockinfo[0] & 0b01111111; // reset first bit if set   
         int blocksize = blockinfo[1] << 16 | blockinfo[2] << 8 | blockinfo[3];
+        pos += 4;
+        if (fsize - pos < static_cast<uintmax_t>(blocksize))
+            throw std::runtime_error("Truncated FLAC metadata in " + filename);
+        pos += blocksize;
         vector<byte> block;
         block.reserve(blocksize);
-        copy_n(infile, blocksize, std::back_inserter(block));
-        ++infile;
-        metablocks.insert({blockbyte, block});
+        if (blocksize != 0) // advancing past an empty block would eat a byte
+        {
+            copy_n(infile, blocksize, std::back_inserter(block));
+            ++infile;
+        }
+        metablocks.push_back({ blockbyte, std::move(block) });
         if (lastblock)
             break;
     }
-    full_headersize = mediafile.tellg();
-    auto fsize = fs::file_size(fs::path(filename.toStdString()));
+    full_headersize = pos;
     remaining_filesize = fsize - full_headersize;
-    if (metablocks.count(4) == 0)
+    if (!find_block(metablocks, 4))
         throw std::runtime_error("No vorbis comments present in file!");
     return metablocks; 
     
 }
 
-std::map<QString, QString> FlacFile::make_vcomments()
+TagMap FlacFile::make_vcomments()
 {
-    auto comment_block = metablocks.at(4);
-    
-    // extract vendor string
-    int vendor_length = (comment_block[0] | comment_block[1] << 8 |
-                        comment_block[2] << 16 | comment_block[3] << 24) + 4;
-    copy_n(comment_block.begin(), vendor_length, 
-           std::back_inserter(vcomment_vendorstring));
-
-    std::map<QString, QString> ret;
-    auto comment_pos = comment_block.begin() + vendor_length; 
-    int expected_comments = get_4le_advance(comment_pos);
-    while (comment_pos != comment_block.end())
-    {
-        int comment_length = get_4le_advance(comment_pos);
-        std::string comment(comment_pos, comment_pos + comment_length);
-        QString qcomment = QString::fromStdString(comment);
-        size_t eq = comment.find("=", 0);
-        QString first = qcomment.sliced(0,eq).toUpper(); // text before
-        QString last = qcomment.sliced(eq+1);  // and after '='
-        ret.insert({first,last});
-        comment_pos += comment_length;
-    }
-    if (ret.size() != expected_comments)
-        throw std::runtime_error("Unexpected number of vorbis comments");
-    return ret;  
+    const auto& comment_block = find_block(metablocks, 4)->second;
+    return parse_vcomments(comment_block.begin(), comment_block.end(),
+                           vcomment_vendorstring, nullptr, &vcomment_order);
 }
 
-void writevec(std::fstream& fs, const vector<byte>& vb)
+
+size_t FlacFile::resident_bytes() const
 {
-    for (const auto& ch : vb)
-        fs << ch;
+    size_t total = header.capacity() + vcomment_vendorstring.capacity();
+    for (const auto& block : metablocks)
+        total += block.second.capacity();
+    for (const auto& p : QTags)
+        total += p.first.capacity() + p.second.capacity();
+    for (const auto& p : vcomment_order)
+        total += p.first.capacity() + p.second.capacity();
+    return total;
 }
 
+static void write_block(std::ostream& os, byte type, bool last,
+                        const vector<byte>& body)
+{
+    os << byte(type | (last ? 128 : 0));
+    auto size = make_3be(body.size());
+    os.write(reinterpret_cast<const char*>(size.data()), 3);
+    os.write(reinterpret_cast<const char*>(body.data()), body.size());
+}
 
-bool FlacFile::write_qtags()
+// padding blocks taking exactly total bytes, headers included (total is
+// 0 or at least 4). a block holds at most 2^24 - 1 bytes, so a bigger
+// stretch is split, never leaving a remainder too small for a header
+static void write_padding(std::ostream& os, size_t total)
 {
-    vector<QString> rejoined;
-    for (const auto& qtag : QTags)
+    const size_t max_block = 0xFFFFFF;
+    while (total != 0)
     {
-        rejoined.push_back(qtag.first + '=' + qtag.second);
+        size_t body = total - 4;
+        if (body > max_block)
+        {
+            body = max_block;
+            if (total - 4 - body < 4)
+                body -= 4;
+        }
+        total -= 4 + body;
+        os << byte(total == 0 ? 1 | 128 : 1);
+        auto size = make_3be(body);
+        os.write(reinterpret_cast<const char*>(size.data()), 3);
+        for (size_t i = 0; i != body; ++i)
+            os << byte(0x00);
     }
-    
-    size_t origsize = metablocks.at(4).size();
-    bool has_padding_block = metablocks.count(1) != 0;
-    size_t padding_size = has_padding_block ? metablocks.at(1).size() : 0;
-    
-    // number of comments bytes(4) + vendor string (captured with size bytes)
-    size_t tagsum = 4 + vcomment_vendorstring.size();
-    for(const auto& p : rejoined)
-        tagsum+= 4 + p.size(); // comment size bytes + comment
-    
-    size_t size_difference;
-    bool rewrite_file = false;
-    if (origsize >= tagsum)  // there's room 
-         size_difference = origsize - tagsum;
-    else if (origsize < tagsum &&  // there's room if we take some padding
-             origsize + padding_size + 4 >= tagsum)
-        size_difference = (padding_size + 4 + origsize) - tagsum;
-    else // there's no room
+}
+
+bool FlacFile::write_qtags()
+{
+    // every block is rewritten, so reopen them if they were dropped
+    if (metablocks.empty())
+        metablocks = make_blocks();
+    
+    vector<byte> comments = build_vcomments(QTags, vcomment_vendorstring,
+                                            &vcomment_order);
+    if (comments.size() > 0xFFFFFF)
+        throw std::out_of_range("Vorbis comments too big for a FLAC block");
+    
+    // the blocks kept, in their order, with the new comments in place of
+    // the old. padding is dropped and made again from whatever space is
+    // left, and with strip_art so is every picture
+    std::vector<std::pair<byte, const vector<byte>*>> kept;
+    bool comments_placed = false;
+    size_t needed = 0;
+    for (const auto& block : metablocks)
     {
-        rewrite_file = true;
-        size_difference = 2000; // padding for later
+        if (block.first == 1 || (strip_art && block.first == 6))
+            continue;
+        if (block.first == 4 && !comments_placed)
+        {
+            kept.push_back({ 4, &comments });
+            comments_placed = true;
+        }
+        else
+            kept.push_back({ block.first, &block.second });
+        needed += 4 + kept.back().second->size();
     }
     
-    
-    if ( size_difference <= 4 ) // extra space, but not enough for padding block
+    // the blocks fit where the old ones were if they fill the space
+    // exactly or leave room for at least a padding header; otherwise the
+    // audio moves, with 2000 bytes of padding for later edits
+    size_t available = full_headersize - 42;
+    bool rewrite_file = needed > available ||
+                        (available - needed != 0 && available - needed < 4);
+    size_t padding = rewrite_file ? 2004 : available - needed;
+    
+    auto flacpath = fs::path(filename);
+    string outrel = filename;
+    if (!in_place)  // write a copy into a directory named for the album
     {
-        rewrite_file = true;
-        size_difference = 2000;
+        string outname = flacpath.filename().string();
+        string filedir = QTags.at("ALBUM");
+        
+        // replace forbidden characters for directory with a space
+        string no_dir_chars = ">:\"/\\|?*";
+        if (filedir.find_first_of(no_dir_chars) != string::npos)
+            for (const auto& ch : no_dir_chars)
+            {   
+                auto index = filedir.find(ch);
+                if (index != string::npos)
+                    filedir[index] = ' ';
+            }
+        
+        outrel = filedir + "\\" + outname;
+        fs::create_directories(filedir);
     }
-    
-    bool make_padding = (!has_padding_block && size_difference > 4) || rewrite_file;
-    
-    auto flacpath = fs::path(filename.toStdString());
-    string outname = flacpath.filename().string();
-    string filedir = QTags.at("ALBUM").toStdString();
-    
-    // replace forbidden characters for directory with a space
-    string no_dir_chars = ">:\"/\\|?*";
-    if (filedir.find_first_of(no_dir_chars) != string::npos)
-        for (const auto& ch : no_dir_chars)
-        {   
-            auto index = filedir.find(ch);
-            if (index != string::npos)
-                filedir[index] = ' ';
-        }
-    
-    string outrel = filedir + "\\" + outname;
-    fs::create_directories(filedir);
-    
-    
-    // should be able to remove these size checks
-    
-    fs::copy(flacpath, outrel);
-    std::fstream biob(outrel, std::ios_base::binary
+    outfile = outrel;
+    
+    // in place, a rewrite is built in a temporary copy since the audio
+    // is still read from the original
+    string target = in_place && rewrite_file ? outrel + ".tagtmp" : outrel;
+    if (target != filename)
+        clone_file(filename, target);
+    std::fstream biob(target, std::ios_base::binary
                       | std::ios_base::out | std::ios_base::in);
     biob.seekp(42, std::ios_base::beg);
+    for (size_t i = 0; i != kept.size(); ++i)
+        write_block(biob, kept[i].first, i + 1 == kept.size() && padding == 0,
+                    *kept[i].second);
+    write_padding(biob, padding);
     
-  
-    int blocks_written = 0;
-    
-    if (metablocks.count(3) != 0) // write application block first
-    {
-        biob << byte(0x03);
-        writevec(biob, make_3be(metablocks.at(3).size()));
-        writevec(biob, metablocks.at(3));
-        ++blocks_written;
-    }
-    // write comment block next
-    if (metablocks.size() > 2)
-        biob << byte(0x04);
-    else
-        biob << byte(0x04 | 128); // signal last block
-    writevec(biob, make_3be(tagsum));
-    writevec(biob, vcomment_vendorstring);
-    writevec(biob, make_4le(rejoined.size()));
-            
-    for ( const auto& tag : rejoined )
-    {
-        writevec(biob, make_4le(tag.size()));
-        for (const auto& ch : tag.toStdString())
-            biob << ch;
-    }
-    ++blocks_written;
-    for (int i = 6; i != 1; --i)
-    {
-        
-        // consider creating logic to allow for removal of pictures
-        // since they really shouldn't be embedded in flac files.
-        if (metablocks.count(i) == 0 || i == 4 || i == 3)
-            continue; 
-        else if ( (blocks_written + 1) == metablocks.size() && 
-                 !has_padding_block && !make_padding ) 
-            biob << byte(i | 128); // signal last block
-        else
-            biob << byte(i); 
-        writevec(biob, make_3be(metablocks.at(i).size()));
-        writevec(biob, metablocks.at(i)); // we know the block exists
-        ++blocks_written;
-    }
-    if (origsize >= tagsum)
+    if (!rewrite_file)
     {
-        vector<byte> newpadding;
-        if (has_padding_block)
-        {
-            if (size_difference > 0)
-            {
-                if (rewrite_file)  // then size_difference was < 4 earlier
-                {
-                    newpadding.reserve(2000);
-                    newpadding = vector<byte>(2000, byte(0x00));
-                }
-                else
-                {        
-                    newpadding = vector<byte>{metablocks.at(1)};
-                    newpadding.insert(newpadding.end(), 
-                                  size_difference, byte(0x00));
-                }
-            }
-            else 
-                newpadding = metablocks.at(1);
-            biob << byte(1 | 128);
-            writevec(biob, make_3be(newpadding.size()));
-            writevec(biob, newpadding);
-        }
-        else if (size_difference > 4) // we need space for padding header at least
-        {
-            biob << byte(0x01 | 128);
-            size_t padding_chars = size_difference - 4;
-            writevec(biob, make_3be(padding_chars));
-            for (size_t i = 0; i != padding_chars; ++i)
-                biob << byte(0x00);
-        }
+        biob.close();
+        if (!biob)
+            throw std::runtime_error("Unable to write " + target);
+        return true;
     }
-    else if (origsize < tagsum &&
-            origsize + padding_size + 4 >= tagsum)
-    {
-        if (size_difference > 4)
-        {
-            biob << byte(0x01 | 128);
-            size_t padding_chars = size_difference - 4;
-            writevec(biob, make_3be(padding_chars));
-            for (size_t i = 0; i != padding_chars; ++i)
-                biob << byte(0x00);
-        }     
     
-    }
-    else if (rewrite_file)
+    std::ifstream mediafile(filename, std::ios_base::binary);
+    mediafile.seekg(full_headersize);
+    vector<char> chunk(1 << 20);
+    for (uintmax_t left = remaining_filesize; left != 0; )
     {
-
-        biob << byte(0x01 | 128);
-        size_t padding_chars = size_difference - 4;
-        vector<char> newpadding(padding_chars, 0x00);
-        newpadding.reserve(padding_chars);
-        writevec(biob, make_3be(padding_chars));
-        biob.write(newpadding.data(), padding_chars);
+        size_t n = static_cast<size_t>(std::min<uintmax_t>(left, chunk.size()));
+        if (!mediafile.read(chunk.data(), n))
+            throw std::runtime_error("Short read copying audio of " + filename);
+        biob.write(chunk.data(), n);
+        left -= n;
     }
     
-    
-    if (!rewrite_file)
-        return true;
-    else
-    {
-        std::ifstream mediafile(filename.toStdString(), std::ios_base::binary);
-        noskipws(mediafile);
-        // std::istream_iterator<byte> infile(mediafile);
-        mediafile.ignore(full_headersize-1);
-        
-        std::vector<char> filebucket;
-        filebucket.reserve(remaining_filesize);
-        filebucket.assign(remaining_filesize,0);
-        
-        mediafile.read(filebucket.data(), filebucket.size());
-        biob.write(filebucket.data(), filebucket.size());
-        
-        return true;
-    }
-}
\ No newline at end of file
+    // the copy may be longer than what was just written
+    auto written = biob.tellp();
+    biob.close();
+    if (!biob)
+        throw std::runtime_error("Unable to write " + target);
+    fs::resize_file(target, written);
+    if (target != outrel)
+        fs::rename(target, outrel);
+    return true;
+}
@@ -3,30 +3,40 @@
 
 #include <vector>
 #include <string>
-#include <map>
-#include <QString>
+#include <utility>
 #include "audiofile.h"
+#include "vcomment.h"
 
 typedef unsigned char byte;
-extern std::map<QString, QString> vorbis_qtags;
+extern TagMap vorbis_qtags;
 
 class FlacFile : public AudioFile
 {
 public:
-    explicit FlacFile(const QString& qs)
-        : AudioFile(), filename(qs) { }
-    std::map<QString, QString>& get_qtags() { return QTags; }
-    std::map<QString, QString> get_standard() { return vorbis_qtags; }
+    explicit FlacFile(std::string_view qs, FilePrefix head = FilePrefix())
+        : AudioFile(std::move(head)), filename(qs) { }
+    TagMap& get_qtags() { return QTags; }
+    TagMap get_standard() { return vorbis_qtags; }
+    std::string get_filename() const { return filename; }
+    std::string get_outfile() const { return outfile; }
+    void drop_buffers() { metablocks.clear(); header.clear(); }
+    size_t resident_bytes() const;
+    void strip_pictures() { strip_art = true; }
 private:
-    QString filename;
+    std::string filename;
+    std::string outfile;
     std::vector<byte> header;
     std::vector<byte> vcomment_vendorstring;
+    VComments vcomment_order;  // filled with QTags
     uintmax_t remaining_filesize;
     size_t full_headersize;
-    std::map<byte, std::vector<byte>> make_blocks();
-    std::map<byte, std::vector<byte>> metablocks = make_blocks();
-    std::map<QString, QString> make_vcomments();
-    std::map<QString, QString> QTags = make_vcomments();
+    bool strip_art = false;
+    // every block after STREAMINFO, (type, body) in file order
+    typedef std::vector<std::pair<byte, std::vector<byte>>> Blocks;
+    Blocks make_blocks();
+    Blocks metablocks = make_blocks();
+    TagMap make_vcomments();
+    TagMap QTags = make_vcomments();
 
     
 public:
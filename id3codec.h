@@ -0,0 +1,168 @@
+#ifndef ID3CODEC_H
+#define ID3CODEC_H
+
+#include <cstdint>
+#include <cstddef>
+
+// ID3v2 integers. the tag header's size is syncsafe (seven bits a byte,
+// top bit clear so it can't look like MPEG sync) in every version; frame
+// sizes are plain big-endian in 2.2 and 2.3 and syncsafe in 2.4
+enum class SizeCoding { Plain, Syncsafe };
+
+template <int Width, SizeCoding Coding>
+struct SizeCodec
+{
+    static constexpr int width = Width;
+    static constexpr int bits = Coding == SizeCoding::Syncsafe ? 7 : 8;
+    static constexpr uint32_t digit = (uint32_t(1) << bits) - 1;
+    static constexpr uint32_t max = Width * bits >= 32
+        ? 0xFFFFFFFF : (uint32_t(1) << Width * bits) - 1;
+
+    static constexpr uint32_t decode(const unsigned char* p)
+    {
+        uint32_t v = 0;
+        for (int i = 0; i != Width; ++i)
+            v = v << bits | (p[i] & digit);
+        return v;
+    }
+
+    // anything above max loses its high bits, so callers check first
+    static constexpr void encode(uint32_t v, unsigned char* p)
+    {
+        for (int i = Width - 1; i >= 0; --i)
+        {
+            p[i] = static_cast<unsigned char>(v & digit);
+            v >>= bits;
+        }
+    }
+};
+
+typedef SizeCodec<4, SizeCoding::Syncsafe> TagSizeCodec;
+
+// bytes a tag takes from its 10 byte header on: header, body, and the
+// footer a 2.4 tag may end with; i.e. where the audio starts
+constexpr uintmax_t id3_tag_extent(const unsigned char* header)
+{
+    return 10 + uintmax_t(TagSizeCodec::decode(header + 6)) +
+           (header[3] == 4 && (header[5] & 0x10) ? 10 : 0);
+}
+
+// frame header layout per major version: id, size, then flags (none in 2.2)
+template <int Version> struct Id3FrameLayout;
+
+template <> struct Id3FrameLayout<2>
+{
+    static constexpr size_t id_size = 3;
+    static constexpr size_t header_size = 6;
+    typedef SizeCodec<3, SizeCoding::Plain> Size;
+};
+
+template <> struct Id3FrameLayout<3>
+{
+    static constexpr size_t id_size = 4;
+    static constexpr size_t header_size = 10;
+    typedef SizeCodec<4, SizeCoding::Plain> Size;
+};
+
+template <> struct Id3FrameLayout<4>
+{
+    static constexpr size_t id_size = 4;
+    static constexpr size_t header_size = 10;
+    typedef SizeCodec<4, SizeCoding::Syncsafe> Size;
+};
+
+// frame headers read and written from the one layout above, so a loop
+// over frames is compiled once per version instead of testing it per frame
+template <int Version>
+struct Id3Frame : Id3FrameLayout<Version>
+{
+    typedef Id3FrameLayout<Version> Layout;
+
+    // the header at p, n bytes before the end of the tag. false at
+    // padding, or where the frame would run past the end
+    static constexpr bool read(const unsigned char* p, size_t n,
+                               uint32_t& body_size)
+    {
+        if (n < Layout::header_size || p[0] == 0)
+            return false;
+        body_size = Layout::Size::decode(p + Layout::id_size);
+        return body_size != 0 && body_size <= n - Layout::header_size;
+    }
+
+    // id is id_size characters; flags are written clear
+    static constexpr void write(unsigned char* p, const char* id,
+                                uint32_t body_size)
+    {
+        for (size_t i = 0; i != Layout::id_size; ++i)
+            p[i] = static_cast<unsigned char>(id[i]);
+        Layout::Size::encode(body_size, p + Layout::id_size);
+        for (size_t i = Layout::id_size + Layout::Size::width;
+             i != Layout::header_size; ++i)
+            p[i] = 0;
+    }
+};
+
+// the layout of a version only known at run time, e.g. for a single
+// lookup ahead of a loop
+struct Id3FrameShape
+{
+    size_t id_size;
+    size_t header_size;
+};
+
+constexpr Id3FrameShape id3_frame_shape(int version)
+{
+    return version == 2 ? Id3FrameShape{ Id3Frame<2>::id_size, Id3Frame<2>::header_size }
+                        : Id3FrameShape{ Id3Frame<3>::id_size, Id3Frame<3>::header_size };
+}
+
+// round trips, checked at compile time: every digit value in every
+// position, the extremes, and a whole frame header per version
+namespace id3codec_checks {
+
+template <typename Codec>
+constexpr bool sizes_round_trip()
+{
+    unsigned char buf[Codec::width]{};
+    for (int pos = 0; pos != Codec::width; ++pos)
+        for (uint32_t d = 0; d <= Codec::digit; ++d)
+        {
+            uint32_t v = d << (pos * Codec::bits);
+            Codec::encode(v, buf);
+            if (Codec::decode(buf) != v)
+                return false;
+            for (unsigned char b : buf)
+                if (b > Codec::digit)
+                    return false;
+        }
+    for (uint32_t v : { uint32_t(0), uint32_t(1), Codec::max, Codec::max - 1,
+                        Codec::max / 2 + 1, uint32_t(0x0A5C3E7F) & Codec::max })
+    {
+        Codec::encode(v, buf);
+        if (Codec::decode(buf) != v)
+            return false;
+    }
+    return true;
+}
+
+template <int Version>
+constexpr bool frame_round_trips()
+{
+    typedef Id3Frame<Version> Frame;
+    unsigned char buf[Frame::header_size + 1]{};
+    uint32_t size = 0;
+    Frame::write(buf, "TALB", 1);
+    return Frame::read(buf, sizeof buf, size) && size == 1 &&
+           buf[0] == 'T' && !Frame::read(buf, sizeof buf - 1, size);
+}
+
+static_assert(sizes_round_trip<SizeCodec<3, SizeCoding::Plain>>(), "2.2 frame size");
+static_assert(sizes_round_trip<SizeCodec<4, SizeCoding::Plain>>(), "2.3 frame size");
+static_assert(sizes_round_trip<SizeCodec<4, SizeCoding::Syncsafe>>(), "syncsafe size");
+static_assert(TagSizeCodec::max == 0x0FFFFFFF, "28 bit tag size");
+static_assert(frame_round_trips<2>() && frame_round_trips<3>() &&
+              frame_round_trips<4>(), "frame header");
+
+}
+
+#endif // ID3CODEC_H
@@ -0,0 +1,257 @@
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include "id3v1.h"
+#include "fileio.h"
+
+typedef unsigned char byte;
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+string latin1_to_utf8(const string& s)
+{
+    string ret;
+    ret.reserve(s.size());
+    for (char ch : s)
+    {
+        byte b = static_cast<byte>(ch);
+        if (b < 0x80)
+            ret += ch;
+        else
+        {
+            ret += static_cast<char>(0xC0 | b >> 6);
+            ret += static_cast<char>(0x80 | (b & 0x3F));
+        }
+    }
+    return ret;
+}
+
+string utf8_to_latin1(const string& s, size_t max)
+{
+    string ret;
+    for (size_t i = 0; i != s.size() && ret.size() != max; )
+    {
+        byte b = static_cast<byte>(s[i]);
+        size_t len = b < 0x80 ? 1 : (b & 0xE0) == 0xC0 ? 2
+                   : (b & 0xF0) == 0xE0 ? 3 : (b & 0xF8) == 0xF0 ? 4 : 0;
+        bool valid = len != 0 && i + len <= s.size();
+        uint32_t cp = len == 1 ? b : b & (0x3F >> (len - 1));
+        for (size_t k = 1; valid && k != len; ++k)
+        {
+            byte cont = static_cast<byte>(s[i + k]);
+            valid = (cont & 0xC0) == 0x80;
+            cp = cp << 6 | (cont & 0x3F);
+        }
+        if (!valid)
+        {
+            // not UTF-8 after all; likely Latin-1 already, keep the byte
+            ret += s[i++];
+            continue;
+        }
+        ret += cp <= 0xFF ? static_cast<char>(cp) : '?';
+        i += len;
+    }
+    return ret;
+}
+
+static string field(const byte* p, size_t n)
+{
+    // fields are null or space padded
+    string ret(p, std::find(p, p + n, 0));
+    while (!ret.empty() && ret.back() == ' ')
+        ret.pop_back();
+    return latin1_to_utf8(ret);
+}
+
+// one byte a character once in Latin-1, so cutting at n never splits one
+static void put_field(vector<byte>& tag, size_t pos, const string& s, size_t n)
+{
+    string latin1 = utf8_to_latin1(s, n);
+    std::copy(latin1.begin(), latin1.end(), tag.begin() + pos);
+}
+
+Id3v1Tag decode_id3v1(const byte* tag)
+{
+    Id3v1Tag ret;
+    ret.title = field(tag + 3, 30);
+    ret.artist = field(tag + 33, 30);
+    ret.album = field(tag + 63, 30);
+    ret.year = field(tag + 93, 4);
+    if (tag[125] == 0 && tag[126] != 0)  // v1.1 track number
+    {
+        ret.comment = field(tag + 97, 28);
+        ret.track = tag[126];
+    }
+    else
+        ret.comment = field(tag + 97, 30);
+    ret.genre = tag[127];
+    return ret;
+}
+
+// the ID3v1 genres by index: 0-79 from the spec, the rest Winamp's
+static const char* const genre_names[] = {
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge",
+    "Hip-Hop", "Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B",
+    "Rap", "Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska",
+    "Death Metal", "Pranks", "Soundtrack", "Euro-Techno", "Ambient",
+    "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance", "Classical",
+    "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+    "Alt. Rock", "Bass", "Soul", "Punk", "Space", "Meditative",
+    "Instrumental Pop", "Instrumental Rock", "Ethnic", "Gothic", "Darkwave",
+    "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+    "Southern Rock", "Comedy", "Cult", "Gangsta Rap", "Top 40",
+    "Christian Rap", "Pop/Funk", "Jungle", "Native American", "Cabaret",
+    "New Wave", "Psychedelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+    "Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical",
+    "Rock & Roll", "Hard Rock", "Folk", "Folk-Rock", "National Folk", "Swing",
+    "Fast-Fusion", "Bebop", "Latin", "Revival", "Celtic", "Bluegrass",
+    "Avantgarde", "Gothic Rock", "Progressive Rock", "Psychedelic Rock",
+    "Symphonic Rock", "Slow Rock", "Big Band", "Chorus", "Easy Listening",
+    "Acoustic", "Humour", "Speech", "Chanson", "Opera", "Chamber Music",
+    "Sonata", "Symphony", "Booty Bass", "Primus", "Porn Groove", "Satire",
+    "Slow Jam", "Club", "Tango", "Samba", "Folklore", "Ballad",
+    "Power Ballad", "Rhythmic Soul", "Freestyle", "Duet", "Punk Rock",
+    "Drum Solo", "A Cappella", "Euro-House", "Dance Hall", "Goa",
+    "Drum & Bass", "Club-House", "Hardcore", "Terror", "Indie", "BritPop",
+    "Afro-Punk", "Polsk Punk", "Beat", "Christian Gangsta Rap", "Heavy Metal",
+    "Black Metal", "Crossover", "Contemporary Christian", "Christian Rock",
+    "Merengue", "Salsa", "Thrash Metal", "Anime", "JPop", "Synthpop",
+    "Abstract", "Art Rock", "Baroque", "Bhangra", "Big Beat", "Breakbeat",
+    "Chillout", "Downtempo", "Dub", "EBM", "Eclectic", "Electro",
+    "Electroclash", "Emo", "Experimental", "Garage", "Global", "IDM",
+    "Illbient", "Industro-Goth", "Jam Band", "Krautrock", "Leftfield",
+    "Lounge", "Math Rock", "New Romantic", "Nu-Breakz", "Post-Punk",
+    "Post-Rock", "Psytrance", "Shoegaze", "Space Rock", "Trop Rock",
+    "World Music", "Neoclassical", "Audiobook", "Audio Theatre",
+    "Neue Deutsche Welle", "Podcast", "Indie Rock", "G-Funk", "Dubstep",
+    "Garage Rock", "Psybient"
+};
+
+// a number: "17", or "(17)" optionally followed by a refinement. text
+// otherwise, matched against the names above ignoring case
+int id3v1_genre(const string& tcon)
+{
+    size_t begin = tcon.size() > 1 && tcon[0] == '(' ? 1 : 0;
+    size_t end = begin;
+    while (end != tcon.size() && std::isdigit(static_cast<byte>(tcon[end])))
+        ++end;
+    bool closed = begin == 0 ? end == tcon.size()
+                             : end != tcon.size() && tcon[end] == ')';
+    if (end != begin && end - begin <= 3 && closed)
+    {
+        int n = std::atoi(tcon.substr(begin, end - begin).c_str());
+        return n < 255 ? n : 255;
+    }
+    
+    auto same = [] (char a, char b)
+    {
+        return std::tolower(static_cast<byte>(a)) ==
+               std::tolower(static_cast<byte>(b));
+    };
+    for (size_t i = 0; i != sizeof genre_names / sizeof genre_names[0]; ++i)
+    {
+        string name = genre_names[i];
+        if (name.size() == tcon.size() &&
+            std::equal(name.begin(), name.end(), tcon.begin(), same))
+            return static_cast<int>(i);
+    }
+    return 255;
+}
+
+vector<byte> encode_id3v1(const Id3v1Tag& tag)
+{
+    vector<byte> ret(128, 0);
+    std::memcpy(ret.data(), "TAG", 3);
+    put_field(ret, 3, tag.title, 30);
+    put_field(ret, 33, tag.artist, 30);
+    put_field(ret, 63, tag.album, 30);
+    put_field(ret, 93, tag.year, 4);
+    if (tag.track > 0 && tag.track < 256)
+    {
+        put_field(ret, 97, tag.comment, 28);
+        ret[126] = static_cast<byte>(tag.track);
+    }
+    else
+        put_field(ret, 97, tag.comment, 30);
+    ret[127] = static_cast<byte>(tag.genre);
+    return ret;
+}
+
+// size of an APEv2 tag whose 32-byte footer is at footer, 0 if none
+static uintmax_t ape_size(const byte* footer)
+{
+    if (std::memcmp(footer, "APETAGEX", 8) != 0)
+        return 0;
+    uintmax_t size = footer[12] | footer[13] << 8 | footer[14] << 16 |
+                     uintmax_t(footer[15]) << 24;
+    bool has_header = footer[23] & 0x80;
+    return size + (has_header ? 32 : 0);
+}
+
+// size of a Lyrics3v2 block whose last 15 bytes are at end, 0 if none
+static uintmax_t lyrics3_size(const byte* end)
+{
+    if (std::memcmp(end + 6, "LYRICS200", 9) != 0)
+        return 0;
+    return std::strtoul(string(end, end + 6).c_str(), nullptr, 10) + 15;
+}
+
+TailInfo read_tail(const string& path, const FilePrefix& prefix)
+{
+    TailInfo ret;
+    uintmax_t fsize = fs::file_size(path);
+    size_t want = static_cast<size_t>(std::min<uintmax_t>(fsize, 160));
+    vector<byte> tail = read_at(prefix, path, fsize - want, want);
+    if (tail.size() != want)
+        throw std::runtime_error("Unable to read tail of " + path);
+    
+    size_t end = tail.size();  // end of the part not yet accounted for
+    if (end >= 128 && std::memcmp(&tail[end - 128], "TAG", 3) == 0)
+    {
+        ret.has_v1 = true;
+        ret.v1 = decode_id3v1(&tail[end - 128]);
+        end -= 128;
+        ret.size += 128;
+    }
+    
+    // APEv2 and Lyrics3 may come in either order before the v1 tag
+    for (int pass = 0; pass != 2; ++pass)
+    {
+        if (end >= 32 && !ret.has_ape)
+            if (uintmax_t sz = ape_size(&tail[end - 32]))
+            {
+                ret.has_ape = true;
+                ret.size += sz;
+            }
+        if (end >= 15 && !ret.has_lyrics3)
+            if (uintmax_t sz = lyrics3_size(&tail[end - 15]))
+            {
+                ret.has_lyrics3 = true;
+                ret.size += sz;
+            }
+        if (pass == 1 || ret.size > fsize || !(ret.has_ape || ret.has_lyrics3))
+            break;
+        
+        // something else may end right where that block began
+        want = static_cast<size_t>(std::min<uintmax_t>(fsize - ret.size, 32));
+        tail = read_at(path, fsize - ret.size - want, want);
+        end = tail.size();
+    }
+    ret.size = std::min(ret.size, fsize);
+    return ret;
+}
+
+void write_id3v1(const string& path, const Id3v1Tag& tag)
+{
+    uintmax_t fsize = fs::file_size(path);
+    if (fsize < 128)
+        throw std::runtime_error("No ID3v1 tag to update in " + path);
+    auto bytes = encode_id3v1(tag);
+    write_at(path, fsize - 128, bytes.data(), bytes.size());
+}
@@ -0,0 +1,53 @@
+#ifndef ID3V1_H
+#define ID3V1_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "fileio.h"
+
+// the fixed 128-byte tag at the very end of an mp3, v1.1 when track != 0.
+// the file holds Latin-1; the strings here are UTF-8
+struct Id3v1Tag
+{
+    std::string title;
+    std::string artist;
+    std::string album;
+    std::string year;
+    std::string comment;
+    int track = 0;
+    int genre = 255;  // 255 = none
+};
+
+// what sits between the audio and EOF
+struct TailInfo
+{
+    bool has_v1 = false;
+    bool has_lyrics3 = false;
+    bool has_ape = false;
+    uintmax_t size = 0;  // total bytes of tail metadata
+    Id3v1Tag v1;
+};
+
+// one positioned read of the last 160 bytes covers the ID3v1 tag and an
+// APEv2 footer or Lyrics3v2 end marker just before it; only when one of
+// those is found is anything further read. a prefix holding the whole
+// file answers the read instead
+TailInfo read_tail(const std::string& path,
+                   const FilePrefix& prefix = FilePrefix());
+
+// ID3v1 text, and ID3v2's encoding 0, is Latin-1. characters Latin-1
+// lacks become '?', and at most max characters are kept
+std::string latin1_to_utf8(const std::string& s);
+std::string utf8_to_latin1(const std::string& s, size_t max = std::string::npos);
+
+// the v1 genre byte for an ID3v2 TCON value, 255 if it names none
+int id3v1_genre(const std::string& tcon);
+
+Id3v1Tag decode_id3v1(const unsigned char* tag);
+std::vector<unsigned char> encode_id3v1(const Id3v1Tag& tag);
+
+// overwrite the existing ID3v1 tag of path with one positioned write
+void write_id3v1(const std::string& path, const Id3v1Tag& tag);
+
+#endif // ID3V1_H
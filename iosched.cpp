@@ -0,0 +1,141 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <numeric>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include "iosched.h"
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+#ifdef __linux__
+
+DiskPlace disk_place(const string& path)
+{
+    DiskPlace ret;
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return ret;
+    ret.device = st.st_dev;
+    ret.inode = st.st_ino;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return ret;
+    // room for the header and a single extent is all we ask for
+    union
+    {
+        fiemap map;
+        char space[sizeof(fiemap) + sizeof(fiemap_extent)];
+    } request{};
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    if (::ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 &&
+        request.map.fm_mapped_extents != 0)
+        ret.first_block = request.map.fm_extents[0].fe_physical;
+    ::close(fd);
+    return ret;
+}
+
+static bool device_rotational(dev_t dev)
+{
+    // a partition has no queue of its own, its disk one level up does
+    std::error_code ec;
+    fs::path sys = fs::canonical("/sys/dev/block/" + std::to_string(major(dev)) +
+                                 ":" + std::to_string(minor(dev)), ec);
+    if (ec)
+        return false;
+    for (const fs::path& dir : { sys, sys.parent_path() })
+    {
+        std::ifstream flag(dir / "queue" / "rotational");
+        int rotational = 0;
+        if (flag >> rotational)
+            return rotational != 0;
+    }
+    return false;
+}
+
+bool on_rotational(const string& path)
+{
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && device_rotational(st.st_dev);
+}
+
+vector<size_t> io_order(const vector<string>& paths)
+{
+    std::map<dev_t, bool> rotational;
+    bool any = false;
+    for (const auto& path : paths)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+            continue;
+        auto it = rotational.find(st.st_dev);
+        if (it == rotational.end())
+            it = rotational.insert({ st.st_dev, device_rotational(st.st_dev) }).first;
+        any = it->second;
+        if (any)
+            break;
+    }
+    if (any)
+        return order_by_extent(paths);
+    vector<size_t> ret(paths.size());
+    std::iota(ret.begin(), ret.end(), 0);
+    return ret;
+}
+
+#else
+
+DiskPlace disk_place(const string&)
+{
+    return DiskPlace();
+}
+
+bool on_rotational(const string&)
+{
+    return false;
+}
+
+vector<size_t> io_order(const vector<string>& paths)
+{
+    vector<size_t> ret(paths.size());
+    std::iota(ret.begin(), ret.end(), 0);
+    return ret;
+}
+
+#endif
+
+vector<size_t> order_by_extent(const vector<string>& paths)
+{
+    vector<DiskPlace> places;
+    places.reserve(paths.size());
+    for (const auto& path : paths)
+        places.push_back(disk_place(path));
+
+    vector<size_t> ret(paths.size());
+    std::iota(ret.begin(), ret.end(), 0);
+    std::stable_sort(ret.begin(), ret.end(), [&places] (size_t a, size_t b)
+    {
+        const DiskPlace& x = places[a];
+        const DiskPlace& y = places[b];
+        if (x.device != y.device)
+            return x.device < y.device;
+        if (x.first_block != y.first_block)
+            return x.first_block < y.first_block;
+        return x.inode < y.inode;
+    });
+    return ret;
+}
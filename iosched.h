@@ -0,0 +1,33 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// where a file starts on disk. first_block is the physical offset of its
+// first extent (FIEMAP), 0 where the filesystem won't say
+struct DiskPlace
+{
+    uintmax_t device = 0;
+    uintmax_t first_block = 0;
+    uintmax_t inode = 0;
+};
+
+DiskPlace disk_place(const std::string& path);
+
+// whether path lives on a spinning disk, going by the rotational flag
+// of its block device (or the whole disk, for a partition)
+bool on_rotational(const std::string& path);
+
+// indices of paths by device, first physical extent and inode, so one
+// pass over them is a single sweep; ties keep their given order
+std::vector<size_t> order_by_extent(const std::vector<std::string>& paths);
+
+// the order batch jobs visit paths in: order_by_extent where any of them
+// is on a spinning disk, otherwise as given, since seeks cost nothing
+// there and the extent lookups would
+std::vector<size_t> io_order(const std::vector<std::string>& paths);
+
+#endif // IOSCHED_H
@@ -0,0 +1,223 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include "journal.h"
+#include "payload.h"
+#include "fileio.h"
+#include "oggfile.h"
+
+typedef unsigned char byte;
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+// records: 'B' batch                          starts a batch
+//          'F' batch path size head tail      one file before its write
+// integers little-endian u64, strings and byte ranges u64 length + bytes
+
+namespace {
+
+void put_u64(std::ostream& os, uint64_t v)
+{
+    char le[8];
+    for (int i = 0; i != 8; ++i)
+        le[i] = char(v >> (8 * i));
+    os.write(le, 8);
+}
+
+void put_bytes(std::ostream& os, const void* data, size_t n)
+{
+    put_u64(os, n);
+    os.write(static_cast<const char*>(data), n);
+}
+
+bool get_u64(std::istream& is, uint64_t& v)
+{
+    byte le[8];
+    if (!is.read(reinterpret_cast<char*>(le), 8))
+        return false;
+    v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = v << 8 | le[i];
+    return true;
+}
+
+bool get_bytes(std::istream& is, string& s)
+{
+    uint64_t n;
+    if (!get_u64(is, n))
+        return false;
+    s.assign(n, '\0');
+    return static_cast<bool>(is.read(s.data(), n));
+}
+
+struct FileRecord
+{
+    uint64_t batch;
+    string path;
+    uint64_t size;
+    string head;
+    string tail;
+};
+
+// reads records until the end or a torn final record
+template <typename Fn>
+void read_journal(const string& journal, Fn on_file, uint64_t* max_batch)
+{
+    std::ifstream is(journal, std::ios_base::binary);
+    char kind;
+    while (is.get(kind))
+    {
+        uint64_t batch;
+        if (!get_u64(is, batch))
+            break;
+        if (max_batch)
+            *max_batch = std::max(*max_batch, batch);
+        if (kind == 'B')
+            continue;
+        FileRecord rec{};
+        rec.batch = batch;
+        if (kind != 'F' || !get_bytes(is, rec.path) || !get_u64(is, rec.size)
+            || !get_bytes(is, rec.head) || !get_bytes(is, rec.tail))
+            break;
+        on_file(rec);
+    }
+}
+
+void revert_file(const FileRecord& rec)
+{
+    // where the audio sits now; the tag writers never change its bytes
+    PayloadRange now = audio_payload(rec.path);
+    uintmax_t audio_len = rec.size - rec.head.size() - rec.tail.size();
+    if (now.end - now.begin < audio_len)
+        throw std::runtime_error("audio shorter than when recorded");
+    
+    // Ogg audio pages are numbered on from the headers, so if the header
+    // page count changed they need renumbering back as well
+    bool ogg = rec.head.compare(0, 4, "OggS") == 0;
+    uint32_t serial = 0, seq_delta = 0;
+    if (ogg)
+    {
+        uint32_t last_seqno = 0;
+        ogg_last_page(reinterpret_cast<const byte*>(rec.head.data()),
+                      rec.head.size(), serial, last_seqno);
+        vector<byte> first = read_at(rec.path, now.begin, 27);
+        if (first.size() == 27)
+            seq_delta = last_seqno + 1 - (first[18] | first[19] << 8 |
+                        first[20] << 16 | uint32_t(first[21]) << 24);
+    }
+    
+    if (now.begin == rec.head.size() && seq_delta == 0)
+    {
+        // header kept its size: put the old bytes back where they were
+        write_at(rec.path, 0, reinterpret_cast<const byte*>(rec.head.data()),
+                 rec.head.size());
+        if (fs::file_size(rec.path) != rec.size)
+            fs::resize_file(rec.path, rec.size);
+        if (!rec.tail.empty())
+            write_at(rec.path, rec.size - rec.tail.size(),
+                     reinterpret_cast<const byte*>(rec.tail.data()),
+                     rec.tail.size());
+        return;
+    }
+    
+    // header changed size, so the audio has to move back
+    string tmp = rec.path + ".tagtmp";
+    {
+        std::ifstream in(rec.path, std::ios_base::binary);
+        std::ofstream out(tmp, std::ios_base::binary);
+        out.write(rec.head.data(), rec.head.size());
+        in.seekg(now.begin);
+        if (ogg)
+            copy_ogg_pages(in, out, serial, seq_delta);
+        vector<char> chunk(1 << 20);
+        for (uintmax_t left = ogg ? 0 : audio_len; left != 0; )
+        {
+            size_t n = std::min<uintmax_t>(left, chunk.size());
+            if (!in.read(chunk.data(), n))
+                throw std::runtime_error("short read");
+            out.write(chunk.data(), n);
+            left -= n;
+        }
+        out.write(rec.tail.data(), rec.tail.size());
+        if (!out)
+            throw std::runtime_error("unable to write " + tmp);
+    }
+    fs::rename(tmp, rec.path);
+}
+
+}
+
+TagJournal::TagJournal(const string& file)
+    : file(file), batch_id(last_batch(file) + 1)
+{
+    bool created = !fs::exists(file);
+    log.open(file, std::ios_base::binary | std::ios_base::app);
+    if (!log)
+        throw std::runtime_error("Unable to open journal " + file);
+    log.put('B');
+    put_u64(log, batch_id);
+    log.flush();
+    // a new journal's name has to survive a crash as much as its records
+    if (created)
+    {
+        sync_path(file);
+        fs::path dir = fs::path(file).parent_path();
+        sync_path(dir.empty() ? "." : dir.string());
+    }
+}
+
+void TagJournal::record(const string& path)
+{
+    PayloadRange audio = audio_payload(path);
+    uintmax_t size = fs::file_size(path);
+    vector<byte> head = read_at(path, 0, audio.begin);
+    vector<byte> tail = read_at(path, audio.end, size - audio.end);
+    if (head.size() != audio.begin || tail.size() != size - audio.end)
+        throw std::runtime_error("Unable to read tags of " + path);
+    
+    log.put('F');
+    put_u64(log, batch_id);
+    put_bytes(log, path.data(), path.size());
+    put_u64(log, size);
+    put_bytes(log, head.data(), head.size());
+    put_bytes(log, tail.data(), tail.size());
+    // on disk before the file is touched, or it's no use as an undo
+    log.flush();
+    if (!log)
+        throw std::runtime_error("Unable to append to journal");
+    sync_path(file);
+}
+
+uint64_t last_batch(const string& journal)
+{
+    uint64_t max_batch = 0;
+    read_journal(journal, [] (const FileRecord&) { }, &max_batch);
+    return max_batch;
+}
+
+RevertStats revert_batch(const string& journal, uint64_t batch)
+{
+    vector<FileRecord> records;
+    read_journal(journal, [&] (const FileRecord& rec)
+                 { if (rec.batch == batch) records.push_back(rec); }, nullptr);
+    
+    // newest first, so a file written twice ends at its oldest state
+    RevertStats stats;
+    for (auto it = records.rbegin(); it != records.rend(); ++it)
+    {
+        try
+        {
+            revert_file(*it);
+            ++stats.files;
+        }
+        catch (const std::exception& e)
+        {
+            stats.errors.push_back(it->path + ": " + e.what());
+        }
+    }
+    return stats;
+}
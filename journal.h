@@ -0,0 +1,41 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+
+// append-only undo log for in-place tag edits. before a file is written,
+// record() saves its original tag bytes, i.e. everything before the audio
+// and everything after it, with the file size. the audio itself is never
+// touched by a tag write, so that is enough to restore the file exactly,
+// at a few KB per file instead of a full copy
+class TagJournal
+{
+public:
+    // opens file for appending and starts a new batch in it
+    explicit TagJournal(const std::string& file);
+    uint64_t batch() const { return batch_id; }
+    // returns once path's record is synced to disk
+    void record(const std::string& path);
+
+private:
+    std::string file;
+    std::ofstream log;
+    uint64_t batch_id;
+};
+
+struct RevertStats
+{
+    size_t files = 0;
+    std::vector<std::string> errors;
+};
+
+// highest batch number in journal, 0 if it has none
+uint64_t last_batch(const std::string& journal);
+
+// put every file recorded in batch back as it was before that batch
+RevertStats revert_batch(const std::string& journal, uint64_t batch);
+
+#endif // JOURNAL_H
@@ -19,19 +19,29 @@
 
 #include "musfile.h"
 #include "flacfile.h"
+#include "cli.h"
+#include "payload.h"
+#include "iosched.h"
+#include "batch.h"
+#include "tagdiff.h"
 
 namespace fs = std::filesystem;
 
-void save_write_tags(AudioFile* audio, std::map<QString, QLineEdit*>& lines)
+// upper bound on raw tag/metadata bytes kept resident by do_folder; files
+// loaded past it keep only their tag map. set with --memory-budget=<MB>
+size_t folder_memory_budget = size_t(256) << 20;
+
+void save_write_tags(AudioFile* audio, std::map<std::string, QLineEdit*>& lines)
 {
     // extract text from each QLineEdit and save to qtags
     for (const auto& line : lines)
     {  
         if (!line.second->text().isEmpty())
-            audio->get_qtags().at(line.first) = line.second->text();
+            audio->get_qtags().at(line.first) = line.second->text().toStdString();
     }
 
-    bool success = audio->write_qtags();
+    bool success = audio->write_qtags() &&
+                   verify_payload(audio->get_filename(), audio->get_outfile());
     QMessageBox msgBox;
     if (success)
         msgBox.setText("Tags written successfully");
@@ -40,37 +50,59 @@ void save_write_tags(AudioFile* audio, std::map<QString, QLineEdit*>& lines)
     msgBox.exec();
 }
 
+static QString join_lines(const std::vector<std::string>& lines)
+{
+    QString ret;
+    for (const auto& line : lines)
+        ret += QString::fromStdString(line) + "\n";
+    return ret;
+}
+
 void save_write_folder(std::vector<AudioFile*>& audiofolder, 
-                       std::map<QString, QLineEdit*>& lines,
-                       std::map<QString, QString>& commontags,
+                       std::map<std::string, QLineEdit*>& lines,
                        QProgressBar* progbar)
 {
-    // extract text from each QLineEdit and save to qtags
+    // every file gets each field that was filled in; the rest already
+    // match or, where they differ, are left as they are
     for (const auto& line : lines)
     {  
-        if (!line.second->text().isEmpty())
-            commontags.at(line.first) = line.second->text();
+        if (line.second->text().isEmpty())
+            continue;
+        std::string text = line.second->text().toStdString();
+        for (AudioFile* audio : audiofolder)
+            audio->get_qtags().at(line.first) = text;
     }
-    for (AudioFile* audio : audiofolder)
-        for (auto& tag : commontags)
-            audio->get_qtags().at(tag.first) = tag.second;
     
-    bool success = all_of(audiofolder.begin(), audiofolder.end(),
-                          [&audiofolder, progbar] (AudioFile* audio) 
-                           {    progbar->setValue(progbar->value() + 1);
+    // a file that fails is listed afterwards, the rest still get written
+    std::map<std::string, AudioFile*> by_path;
+    std::vector<std::string> paths;
+    for (AudioFile* audio : audiofolder)
+    {
+        by_path[audio->get_filename()] = audio;
+        paths.push_back(audio->get_filename());
+    }
+    BatchResult batch = run_batch(paths, [&by_path, progbar] (const std::string& path)
+                           {    AudioFile* audio = by_path.at(path);
+                                progbar->setValue(progbar->value() + 1);
                                 QApplication::processEvents();
-                                return audio->write_qtags(); } );
+                                bool ok = audio->write_qtags() &&
+                                    verify_payload(audio->get_filename(),
+                                                   audio->get_outfile());
+                                audio->drop_buffers(); // written, release
+                                return ok; } );
     for (auto audio: audiofolder)
         delete audio;
     
     QMessageBox msgBox;
-    if (success)
-    {
-        progbar->setValue(progbar->maximum());
+    progbar->setValue(progbar->maximum());
+    if (batch.errors.empty())
         msgBox.setText("Tags written successfully");
-    }
     else
-        msgBox.setText("Operation Failed");
+    {
+        msgBox.setText(QString("Tags written to %1 files, %2 failed")
+                       .arg(batch.done).arg(batch.errors.size()));
+        msgBox.setDetailedText(join_lines(batch.errors));
+    }
     msgBox.exec();
 }
 
@@ -82,100 +114,103 @@ void do_folder(QWidget* central)
     
     
     QString opendir = QFileDialog::getExistingDirectory(0,
-                     "Choose Folder of only MP3 or only FLAC", "C:\\", QFileDialog::ShowDirsOnly);
+                     "Choose Folder of only MP3, only FLAC, only Ogg or only MP4",
+                     "C:\\",
+                     QFileDialog::ShowDirsOnly);
     fs::path filedir = opendir.toStdString();
-    fs::directory_iterator dirit(filedir);
-    
-    bool mp3_type;
-    // allow other non-audio types, there has to be a better way to do this
-    std::vector<std::string> filetypes{".jpg", ".jpeg", ".md5", ".cue", ".nfo",
-                             ".m3u", ".bmp", ".tiff", ".log", ".txt",
-                             ".png", ".crc", ".html"};
-    if (std::all_of(begin(dirit), end(dirit), [&] (const fs::directory_entry& entry)
-            {       
-                std::string ext = entry.path().extension().string();
-                for (auto& ch : ext)
-                    ch = tolower(ch);
-                    
-                
-                    
-                if (find(filetypes.begin(), filetypes.end(), ext) != filetypes.end())
-                {  
-                    qInfo() << ext;
-                    return true;
-                }
-                else
-                    return ext == ".mp3"; 
-            } ))
-        mp3_type = true;
-    else if (std::all_of(begin(dirit), end(dirit), [&] (const fs::directory_entry& entry)
-            {       
-                std::string ext = entry.path().extension().string();
-                for (auto& ch : ext)
-                    ch = tolower(ch);
-                
-                if (find(filetypes.begin(), filetypes.end(), ext) != filetypes.end())
-                {  
-                    qInfo() << ext;
-                    return true;
-                }
-                else
-                    return ext == ".flac"; 
-            } ))
-        mp3_type = false;
-    else
+    
+    // Vorbis and Opus share the comment format, so they may be mixed
+    std::vector<std::vector<std::string>> audiotypes{{".mp3"}, {".flac"},
+                                                    {".ogg", ".oga", ".opus"},
+                                                    {".m4a", ".m4b", ".mp4"}};
+    // the folder is edited as its most common audio type. files of any
+    // other type, like ones that won't open, are skipped and listed
+    std::vector<std::vector<std::string>> by_type(audiotypes.size());
+    for (const auto& entry : fs::directory_iterator(filedir))
     {
-        throw std::runtime_error("Mixed audio types not supported");
+        std::string ext = entry.path().extension().string();
+        for (auto& ch : ext)
+            ch = tolower(ch);
+        for (size_t t = 0; t != audiotypes.size(); ++t)
+            if (find(audiotypes[t].begin(), audiotypes[t].end(), ext) != audiotypes[t].end())
+                by_type[t].push_back(entry.path().string());
     }
+    auto folder_type = std::max_element(by_type.begin(), by_type.end(),
+            [] (const std::vector<std::string>& a, const std::vector<std::string>& b)
+            { return a.size() < b.size(); });
+    std::vector<std::string> skipped;
+    for (const auto& other : by_type)
+        if (&other != &*folder_type)
+            for (const auto& path : other)
+                skipped.push_back(path + ": different audio type");
     
     std::vector<AudioFile*> audiofolder;
+    size_t resident = 0;
+    auto keep_in_budget = [&resident] (AudioFile* audio)
+    {
+        // once the budget is spent, later files keep only their tags
+        resident += audio->resident_bytes();
+        if (resident > folder_memory_budget)
+        {
+            resident -= audio->resident_bytes();
+            audio->drop_buffers();
+            resident += audio->resident_bytes();
+        }
+    };
     
-    dirit = fs::directory_iterator(filedir); // reinitialize iterator
-    for (const auto& p : dirit)
+    // on a spinning disk files are read, and later written, in the order
+    // they lie on the platter rather than directory order
+    const std::vector<std::string>& paths = *folder_type;
+    for (size_t i : io_order(paths))
     {
-        std::string ext = p.path().extension().string();
-        for (auto& ch : ext)
-            ch = tolower(ch);
-        if (mp3_type)
+        try
         {
-            if (ext == ".mp3")
-                audiofolder.emplace_back(new MusFile(QString::fromStdString(p.path().string())));
-            
+            audiofolder.emplace_back(open_audio_file(paths[i]));
         }
-        else
+        catch (const std::exception& e)
         {
-            if (ext == ".flac")
-            audiofolder.emplace_back(new FlacFile(QString::fromStdString(p.path().string())));
+            skipped.push_back(paths[i] + ": " + e.what());
+            continue;
         }
-    } 
+        keep_in_budget(audiofolder.back());
+    }
     if (audiofolder.empty())
         throw std::runtime_error("No Files in Directory");
-    
-    QFormLayout* flayout = new QFormLayout(central);
-    std::map<QString, QString> common_tags;
-    
-    for (const auto& tag : audiofolder[0]->get_qtags())
+    if (!skipped.empty())
     {
-        if (std::all_of(audiofolder.begin(), audiofolder.end(), [&tag] 
-                (AudioFile* audio)
-                { if (audio->get_qtags().count(tag.first) != 0)
-                    return audio->get_qtags().at(tag.first) == tag.second;
-                  else 
-                    return false; } ) )
-            common_tags.insert(tag);
+        QMessageBox msgBox;
+        msgBox.setText(QString("%1 files skipped").arg(skipped.size()));
+        msgBox.setDetailedText(join_lines(skipped));
+        msgBox.exec();
     }
     
+    QFormLayout* flayout = new QFormLayout(central);
+    std::vector<const TagMap*> folder_tags;
+    for (AudioFile* audio : audiofolder)
+        folder_tags.push_back(&audio->get_qtags());
+    TagDiff diff(folder_tags);
+    TagMap standard = audiofolder[0]->get_standard();
     
-    std::map<QString, QLineEdit*> lines;
+    std::map<std::string, QLineEdit*> lines;
     
-    for (const auto& qs : common_tags)
+    // a field shows its value where the files agree and how many values
+    // there are where they don't; one some files lack can't be set on all
+    for (const auto& field : diff.fields())
     {
+        if (diff.missing(field))
+            continue;
+        std::string key(field.key);
         QLineEdit* line = new QLineEdit();
-        line->setPlaceholderText(qs.second);
-        line->setObjectName(qs.first);
-        lines.insert({qs.first, line});
+        if (diff.common(field))
+            line->setPlaceholderText(QString::fromStdString(
+                                         std::string(field.values[0].text)));
+        else
+            line->setPlaceholderText(QString("%1 distinct values")
+                                     .arg(field.values.size()));
+        line->setObjectName(QString::fromStdString(key));
+        lines.insert({key, line});
         
-        flayout->addRow(new QLabel(audiofolder[0]->get_standard().at(qs.first)),
+        flayout->addRow(new QLabel(QString::fromStdString(standard.at(key))),
                     line);
            
     }
@@ -188,33 +223,30 @@ void do_folder(QWidget* central)
     
     
     QObject::connect(goButton, &QPushButton::clicked, 
-                     [audiofolder, lines, common_tags, flayout, folderprog] () mutable 
+                     [audiofolder, lines, flayout, folderprog] () mutable 
                      { flayout->addRow(folderprog);
-                       save_write_folder(audiofolder, lines, common_tags, folderprog); } );   
+                       save_write_folder(audiofolder, lines, folderprog); } );   
 }
 
 
 void do_single_file(QWidget* central)
 {
-    std::map<QString, QLineEdit*> lines;
+    std::map<std::string, QLineEdit*> lines;
     QString filename = QFileDialog::getOpenFileName(0,
-        "Open Audio file", "C:\\", "MP3 or FLAC Files (*.mp3 *.flac)");
+        "Open Audio file", "C:\\", "Audio Files (*.mp3 *.flac *.ogg *.oga *.opus *.m4a *.m4b *.mp4)");
     
-    AudioFile* audiofile;
-    if (fs::path(filename.toStdString()).filename().extension() == ".mp3") 
-        audiofile = new MusFile(filename);
-    else
-        audiofile = new FlacFile(filename);
+    AudioFile* audiofile = open_audio_file(filename.toStdString());
     
     QFormLayout* flayout = new QFormLayout(central);
     
     for (const auto& qs : audiofile->get_qtags())
     {
         QLineEdit* line = new QLineEdit();
-        line->setPlaceholderText(qs.second);
-        line->setObjectName(qs.first);
+        line->setPlaceholderText(QString::fromStdString(qs.second));
+        line->setObjectName(QString::fromStdString(qs.first));
         lines.insert({qs.first, line});
-        flayout->addRow(new QLabel(audiofile->get_standard().at(qs.first)),
+        flayout->addRow(new QLabel(QString::fromStdString(
+                            audiofile->get_standard().at(qs.first))),
                         line);
     }
     QPushButton* goButton = new QPushButton("Save ID3 tags");
@@ -229,6 +261,18 @@ void do_single_file(QWidget* central)
 
 int main(int argc, char *argv[])
 {
+    // batch commands run without bringing up the GUI at all
+    int cli_status = run_cli(argc, argv);
+    if (cli_status >= 0)
+        return cli_status;
+    
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--memory-budget=", 0) == 0)
+            folder_memory_budget = std::stoull(arg.substr(16)) << 20;
+    }
+    
     QApplication a(argc, argv);
     QMainWindow w;
     w.setWindowTitle("Simple ID3/Vorbis Tag Editor");
@@ -237,7 +281,7 @@ int main(int argc, char *argv[])
     
     QMessageBox initBox;
     initBox.setText("Welcome, please choose to edit tags for"
-                    "\na single Mp3/FLAC or a folder of all one type");
+                    "\na single Mp3/FLAC/Ogg/M4A or a folder of all one type");
     initBox.addButton("Single file", QMessageBox::AcceptRole);
     initBox.addButton("Folder", QMessageBox::YesRole);
     int ret = initBox.exec();
@@ -0,0 +1,594 @@
+#include <vector>
+#include <fstream>
+#include <ios>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <utility>
+#include "mp4file.h"
+#include "fileio.h"
+
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+namespace {
+
+uint32_t get_be32(const byte* p)
+{
+    return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+uint64_t get_be64(const byte* p)
+{
+    return uint64_t(get_be32(p)) << 32 | get_be32(p + 4);
+}
+
+void put_be32(byte* p, uint32_t v)
+{
+    for (int i = 0; i != 4; ++i)
+        p[i] = (v >> (24 - 8 * i)) & 255;
+}
+
+void put_be64(byte* p, uint64_t v)
+{
+    put_be32(p, static_cast<uint32_t>(v >> 32));
+    put_be32(p + 4, static_cast<uint32_t>(v));
+}
+
+void append_be32(vector<byte>& v, uint32_t x)
+{
+    v.resize(v.size() + 4);
+    put_be32(&v[v.size() - 4], x);
+}
+
+struct Atom
+{
+    size_t pos = 0;      // of the header, within its buffer
+    size_t header = 8;   // 16 with a 64-bit size
+    uint64_t size = 0;   // header included; 0 when absent
+    string type;
+};
+
+// the atoms spanning [begin, end) of buf
+vector<Atom> children(const vector<byte>& buf, size_t begin, size_t end)
+{
+    vector<Atom> ret;
+    size_t pos = begin;
+    while (end - pos >= 8)
+    {
+        Atom atom{ pos, 8, get_be32(&buf[pos]),
+                   string(&buf[pos + 4], &buf[pos + 8]) };
+        if (atom.size == 1)
+        {
+            if (end - pos < 16)
+                throw std::runtime_error("Bad MP4 atom " + atom.type);
+            atom.header = 16;
+            atom.size = get_be64(&buf[pos + 8]);
+        }
+        else if (atom.size == 0)  // runs to the end of its parent
+            atom.size = end - pos;
+        if (atom.size < atom.header || atom.size > end - pos)
+            throw std::runtime_error("Bad MP4 atom " + atom.type);
+        ret.push_back(atom);
+        pos += atom.size;
+    }
+    return ret;
+}
+
+vector<Atom> children(const vector<byte>& buf, const Atom& parent,
+                      size_t skip = 0)
+{
+    return children(buf, parent.pos + parent.header + skip,
+                    parent.pos + parent.size);
+}
+
+Atom find_child(const vector<Atom>& atoms, const char* type)
+{
+    for (const auto& atom : atoms)
+        if (atom.type == type)
+            return atom;
+    return Atom();
+}
+
+bool is_free(const Atom& atom)
+{
+    return atom.size != 0 && (atom.type == "free" || atom.type == "skip");
+}
+
+// iTunes meta is a full atom, with version and flags before its children;
+// QuickTime's goes straight to hdlr
+size_t meta_skip(const vector<byte>& buf, const Atom& meta)
+{
+    size_t body = meta.pos + meta.header;
+    if (meta.size - meta.header >= 8 &&
+        std::memcmp(&buf[body + 4], "hdlr", 4) == 0)
+        return 0;
+    return 4;
+}
+
+// moov/udta/meta/ilst as far as it exists, plus the atom after ilst
+struct IlstPath
+{
+    Atom moov, udta, meta, ilst, after;
+};
+
+IlstPath locate_ilst(const vector<byte>& moov)
+{
+    IlstPath path;
+    path.moov = children(moov, 0, moov.size()).at(0);
+    path.udta = find_child(children(moov, path.moov), "udta");
+    if (path.udta.size == 0)
+        return path;
+    path.meta = find_child(children(moov, path.udta), "meta");
+    if (path.meta.size == 0)
+        return path;
+    auto items = children(moov, path.meta, meta_skip(moov, path.meta));
+    for (size_t i = 0; i != items.size(); ++i)
+        if (items[i].type == "ilst")
+        {
+            path.ilst = items[i];
+            if (i + 1 != items.size())
+                path.after = items[i + 1];
+        }
+    return path;
+}
+
+void grow_atom(vector<byte>& buf, const Atom& atom, intmax_t by)
+{
+    if (atom.size == 0)
+        return;
+    uint64_t size = atom.size + by;
+    if (atom.header == 16)
+        put_be64(&buf[atom.pos + 8], size);
+    else if (size > 0xFFFFFFFF)
+        throw std::out_of_range("MP4 atom too large");
+    else
+        put_be32(&buf[atom.pos], static_cast<uint32_t>(size));
+}
+
+vector<byte> free_atom_header(uint64_t size)
+{
+    vector<byte> ret;
+    append_be32(ret, static_cast<uint32_t>(size));
+    ret.insert(ret.end(), {'f', 'r', 'e', 'e'});
+    return ret;
+}
+
+// every stco/co64 entry pointing at or past from moves by shift
+void shift_chunk_offsets(vector<byte>& moov, uint64_t from, intmax_t shift)
+{
+    Atom root = children(moov, 0, moov.size()).at(0);
+    for (const auto& trak : children(moov, root))
+    {
+        if (trak.type != "trak")
+            continue;
+        Atom mdia = find_child(children(moov, trak), "mdia");
+        Atom minf = mdia.size ? find_child(children(moov, mdia), "minf") : Atom();
+        Atom stbl = minf.size ? find_child(children(moov, minf), "stbl") : Atom();
+        if (stbl.size == 0)
+            continue;
+        for (const auto& table : children(moov, stbl))
+        {
+            bool wide = table.type == "co64";
+            if (!wide && table.type != "stco")
+                continue;
+            size_t body = table.pos + table.header;
+            uint32_t count = get_be32(&moov[body + 4]);
+            size_t width = wide ? 8 : 4;
+            if (8 + count * width > table.size - table.header)
+                throw std::runtime_error("Bad MP4 chunk offset table");
+            for (size_t i = 0; i != count; ++i)
+            {
+                byte* entry = &moov[body + 8 + i * width];
+                uint64_t offset = wide ? get_be64(entry) : get_be32(entry);
+                if (offset < from)
+                    continue;
+                offset += shift;
+                if (wide)
+                    put_be64(entry, offset);
+                else if (offset > 0xFFFFFFFF)
+                    throw std::out_of_range("Chunk offset overflows stco");
+                else
+                    put_be32(entry, static_cast<uint32_t>(offset));
+            }
+        }
+    }
+}
+
+// atom names may carry a (C) sign, Latin-1 in the file, UTF-8 as a key
+string key_of(const string& type)
+{
+    string ret;
+    for (char ch : type)
+        if (static_cast<byte>(ch) == 0xA9)
+            ret += "\xC2\xA9";
+        else
+            ret += ch;
+    return ret;
+}
+
+string atom_of(const string& key)
+{
+    string ret = key;
+    for (size_t i = ret.find("\xC2\xA9"); i != string::npos;
+         i = ret.find("\xC2\xA9", i))
+        ret.replace(i, 2, "\xA9");
+    if (ret.size() != 4)
+        throw std::invalid_argument("Not an MP4 item atom: " + key);
+    return ret;
+}
+
+vector<byte> item_atom(const string& type, uint32_t data_type,
+                       const vector<byte>& value)
+{
+    vector<byte> ret;
+    append_be32(ret, static_cast<uint32_t>(24 + value.size()));
+    ret.insert(ret.end(), type.begin(), type.end());
+    append_be32(ret, static_cast<uint32_t>(16 + value.size()));
+    ret.insert(ret.end(), {'d', 'a', 't', 'a'});
+    append_be32(ret, data_type);
+    append_be32(ret, 0);  // locale
+    ret.insert(ret.end(), value.begin(), value.end());
+    return ret;
+}
+
+// top-level atom headers only, then the moov atom itself
+Mp4Layout scan_layout(const string& path, vector<byte>& moov,
+                      const FilePrefix& prefix = FilePrefix())
+{
+    Mp4Layout layout;
+    uintmax_t fsize = fs::file_size(path);
+    bool have_moov = false;
+    bool after_moov = false;
+    for (uintmax_t pos = 0; fsize - pos >= 8; )
+    {
+        vector<byte> head = read_at(prefix, path, pos, 16);
+        uint64_t size = get_be32(head.data());
+        string type(head.begin() + 4, head.begin() + 8);
+        if (size == 1 && head.size() == 16)
+            size = get_be64(&head[8]);
+        else if (size == 0)
+            size = fsize - pos;
+        if (size < 8 || size > fsize - pos)
+            throw std::runtime_error("Bad MP4 atom " + type + " in " + path);
+
+        bool free = type == "free" || type == "skip";
+        if (after_moov && free)
+            layout.moov_free = size;
+        if (have_moov && !free)
+            layout.moov_last = false;
+        after_moov = false;
+        if (type == "moov")
+        {
+            layout.moov_offset = pos;
+            layout.moov_size = size;
+            layout.moov_last = true;
+            have_moov = after_moov = true;
+        }
+        else if (type == "moof")
+            layout.fragmented = true;
+        pos += size;
+    }
+    if (!have_moov)
+        throw std::runtime_error("No moov atom in " + path);
+
+    moov = read_at(prefix, path, layout.moov_offset, layout.moov_size);
+    IlstPath ilst = locate_ilst(moov);
+    layout.has_ilst = ilst.ilst.size != 0;
+    layout.ilst_size = ilst.ilst.size;
+    layout.ilst_free = is_free(ilst.after) ? ilst.after.size : 0;
+    return layout;
+}
+
+}
+
+Mp4Layout mp4_layout(const string& path)
+{
+    vector<byte> moov;
+    return scan_layout(path, moov);
+}
+
+vector<Mp4Cover> mp4_covers(const string& path)
+{
+    vector<byte> moov;
+    Mp4Layout layout = scan_layout(path, moov);
+    vector<Mp4Cover> ret;
+    IlstPath ilst = locate_ilst(moov);
+    if (ilst.ilst.size == 0)
+        return ret;
+    Atom covr = find_child(children(moov, ilst.ilst), "covr");
+    if (covr.size == 0)
+        return ret;
+    // one data atom per image: type and locale (8), then the image
+    for (const auto& data : children(moov, covr))
+        if (data.type == "data" && data.size >= data.header + 8)
+        {
+            size_t body = data.pos + data.header;
+            ret.push_back({ layout.moov_offset + body + 8,
+                            data.size - data.header - 8,
+                            get_be32(&moov[body]) & 0xFFFFFF });
+        }
+    return ret;
+}
+
+bool mp4_fits_in_place(const Mp4Layout& layout, intmax_t delta)
+{
+    // taken from the free atom after ilst, moov keeps its size
+    intmax_t ilst_free = layout.ilst_free;
+    if (ilst_free != 0 && (ilst_free - delta >= 8 || ilst_free == delta))
+        return true;
+    // moov shrinks into a new free atom, or grows into the one after it
+    if (delta == 0 || delta <= -8)
+        return true;
+    intmax_t moov_free = layout.moov_free;
+    if (moov_free != 0 && (moov_free - delta >= 8 || moov_free == delta))
+        return true;
+    // nothing but free space after moov, so it can simply grow
+    return layout.moov_last;
+}
+
+vector<byte> Mp4File::make_moov()
+{
+    vector<byte> ret;
+    layout = scan_layout(filename, ret, std::exchange(prefix, FilePrefix()));
+    return ret;
+}
+
+TagMap Mp4File::make_items()
+{
+    raw_items.clear();
+    TagMap ret;
+    IlstPath path = locate_ilst(moov);
+    if (path.ilst.size == 0)
+        return ret;
+    for (const auto& item : children(moov, path.ilst))
+    {
+        string key = key_of(item.type);
+        auto data = children(moov, item);
+        const byte* value = nullptr;
+        size_t length = 0;
+        uint32_t data_type = 0;
+        if (data.size() == 1 && data[0].type == "data" &&
+            data[0].size >= data[0].header + 8)
+        {
+            value = &moov[data[0].pos + data[0].header + 8];
+            length = data[0].size - data[0].header - 8;
+            data_type = get_be32(value - 8) & 0xFFFFFF;
+        }
+
+        if (value && data_type == 1)  // UTF-8 text
+            ret.insert({ key, string(value, value + length) });
+        else if (value && (key == "trkn" || key == "disk") && length >= 6)
+        {
+            // number and total as two 16-bit fields after two padding bytes
+            int number = value[2] << 8 | value[3];
+            int total = value[4] << 8 | value[5];
+            ret.insert({ key, total ? std::to_string(number) + "/" +
+                         std::to_string(total) : std::to_string(number) });
+        }
+        else
+            raw_items.emplace_back(moov.begin() + item.pos,
+                                   moov.begin() + item.pos + item.size);
+    }
+    return ret;
+}
+
+void Mp4File::drop_buffers()
+{
+    vector<byte>().swap(moov);
+    vector<vector<byte>>().swap(raw_items);
+}
+
+size_t Mp4File::resident_bytes() const
+{
+    size_t total = moov.capacity();
+    for (const auto& item : raw_items)
+        total += item.capacity();
+    for (const auto& p : QTags)
+        total += p.first.capacity() + p.second.capacity();
+    return total;
+}
+
+vector<byte> Mp4File::make_ilst() const
+{
+    vector<byte> ret{ 0, 0, 0, 0, 'i', 'l', 's', 't' };
+    for (const auto& p : QTags)
+    {
+        string type = atom_of(p.first);
+        vector<byte> item;
+        if (type == "trkn" || type == "disk")
+        {
+            size_t slash = p.second.find('/');
+            int number = std::atoi(p.second.c_str());
+            int total = slash == string::npos ? 0 :
+                        std::atoi(p.second.c_str() + slash + 1);
+            vector<byte> value{ 0, 0, byte(number >> 8), byte(number),
+                                byte(total >> 8), byte(total) };
+            if (type == "trkn")
+                value.insert(value.end(), 2, 0);
+            item = item_atom(type, 0, value);
+        }
+        else
+            item = item_atom(type, 1, vector<byte>(p.second.begin(),
+                                                   p.second.end()));
+        ret.insert(ret.end(), item.begin(), item.end());
+    }
+    for (const auto& item : raw_items)
+    {
+        if (strip_art && std::memcmp(&item[4], "covr", 4) == 0)
+            continue;
+        ret.insert(ret.end(), item.begin(), item.end());
+    }
+    put_be32(ret.data(), static_cast<uint32_t>(ret.size()));
+    return ret;
+}
+
+bool Mp4File::write_qtags()
+{
+    // the rest of moov goes back out unchanged, so reload it if dropped
+    if (moov.empty())
+    {
+        moov = make_moov();
+        make_items();  // only for raw_items, QTags holds the edits
+    }
+    vector<byte> ilst = make_ilst();  // throws on bad keys, before any I/O
+
+    // splice the new ilst into a copy of moov, soaking up size changes in
+    // a free atom after ilst where there is one
+    IlstPath path = locate_ilst(moov);
+    vector<byte> newmoov = moov;
+    intmax_t grow;
+    size_t at;
+    if (path.ilst.size != 0)
+    {
+        intmax_t delta = intmax_t(ilst.size()) - intmax_t(path.ilst.size);
+        size_t replaced = path.ilst.size;
+        intmax_t slack = is_free(path.after) ? path.after.size : 0;
+        if (slack != 0 && (slack - delta >= 8 || slack == delta))
+        {
+            replaced += slack;
+            if (slack != delta)
+            {
+                vector<byte> pad = free_atom_header(slack - delta);
+                pad.resize(slack - delta);
+                ilst.insert(ilst.end(), pad.begin(), pad.end());
+            }
+        }
+        else if (slack == 0 && delta <= -8)
+        {
+            vector<byte> pad = free_atom_header(-delta);
+            pad.resize(-delta);
+            ilst.insert(ilst.end(), pad.begin(), pad.end());
+        }
+        at = path.ilst.pos;
+        newmoov.erase(newmoov.begin() + at, newmoov.begin() + at + replaced);
+        grow = intmax_t(ilst.size()) - intmax_t(replaced);
+    }
+    else
+    {
+        // no ilst yet: add whatever of udta/meta/ilst is missing, with the
+        // handler iTunes expects inside meta
+        if (path.meta.size == 0)
+        {
+            vector<byte> meta{ 0, 0, 0, 0, 'm', 'e', 't', 'a', 0, 0, 0, 0,
+                               0, 0, 0, 33, 'h', 'd', 'l', 'r', 0, 0, 0, 0,
+                               0, 0, 0, 0, 'm', 'd', 'i', 'r', 'a', 'p', 'p',
+                               'l', 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+            meta.insert(meta.end(), ilst.begin(), ilst.end());
+            put_be32(meta.data(), static_cast<uint32_t>(meta.size()));
+            ilst.swap(meta);
+        }
+        if (path.udta.size == 0)
+        {
+            vector<byte> udta{ 0, 0, 0, 0, 'u', 'd', 't', 'a' };
+            udta.insert(udta.end(), ilst.begin(), ilst.end());
+            put_be32(udta.data(), static_cast<uint32_t>(udta.size()));
+            ilst.swap(udta);
+        }
+        const Atom& parent = path.meta.size ? path.meta :
+                             path.udta.size ? path.udta : path.moov;
+        at = parent.pos + parent.size;
+        grow = ilst.size();
+    }
+    newmoov.insert(newmoov.begin() + at, ilst.begin(), ilst.end());
+    for (const Atom* atom : { &path.moov, &path.udta, &path.meta })
+        grow_atom(newmoov, *atom, grow);
+
+    auto mp4path = fs::path(filename);
+    string outrel = filename;
+    if (!in_place)  // write a copy into a directory named for the album
+    {
+        string outname = mp4path.filename().string();
+        string filedir = QTags.at("\xC2\xA9" "alb");
+
+        // replace forbidden characters for directory with a space
+        string no_dir_chars = ">:\"/\\|?*";
+        if (filedir.find_first_of(no_dir_chars) != string::npos)
+            for (const auto& ch : no_dir_chars)
+            {
+                auto index = filedir.find(ch);
+                if (index != string::npos)
+                    filedir[index] = ' ';
+            }
+
+        outrel = filedir + "\\" + outname;
+        fs::create_directories(filedir);
+    }
+    outfile = outrel;
+
+    // moov keeps its place if it fits the free space after it, or has
+    // nothing but free space behind it
+    intmax_t delta = intmax_t(newmoov.size()) - intmax_t(layout.moov_size);
+    intmax_t slack = layout.moov_free;
+    bool fits = delta == 0 || delta <= -8 || layout.moov_last ||
+                (slack != 0 && (slack - delta >= 8 || slack == delta));
+    if (fits)
+    {
+        if (!in_place)
+            clone_file(filename, outrel);
+        vector<byte> out = newmoov;
+        if (delta != 0 && !layout.moov_last)
+        {
+            // what's left of the old moov and its free atom becomes free
+            intmax_t left = slack != 0 ? slack - delta : -delta;
+            if (left != 0)
+            {
+                vector<byte> pad = free_atom_header(left);
+                out.insert(out.end(), pad.begin(), pad.end());
+            }
+        }
+        write_at(outrel, layout.moov_offset, out.data(), out.size());
+        if (layout.moov_last)
+            fs::resize_file(outrel, layout.moov_offset + newmoov.size());
+    }
+    else  // moov moves the media data along, so rewrite the file
+    {
+        if (layout.fragmented)
+            throw std::runtime_error("Fragmented MP4 with no room for tags");
+        // leave room for later edits, as the FLAC writer does
+        const intmax_t padding = 2048;
+        intmax_t shift = intmax_t(newmoov.size()) + padding -
+                         intmax_t(layout.moov_size);
+        shift_chunk_offsets(newmoov, layout.moov_offset + layout.moov_size,
+                            shift);
+        vector<byte> pad = free_atom_header(padding);
+        pad.resize(padding);
+        newmoov.insert(newmoov.end(), pad.begin(), pad.end());
+
+        // in place, build the new file beside the original and swap it
+        // in afterwards, since the media is still read from the original
+        string target = in_place ? outrel + ".tagtmp" : outrel;
+        std::ifstream mediafile(filename, std::ios_base::binary);
+        std::ofstream bob(target, std::ios_base::binary);
+        vector<char> chunk(1 << 20);
+        auto copy_bytes = [&] (uintmax_t left)
+        {
+            while (left != 0)
+            {
+                size_t n = std::min<uintmax_t>(left, chunk.size());
+                if (!mediafile.read(chunk.data(), n))
+                    throw std::runtime_error("Short read from " + filename);
+                bob.write(chunk.data(), n);
+                left -= n;
+            }
+        };
+        copy_bytes(layout.moov_offset);
+        bob.write(reinterpret_cast<const char*>(newmoov.data()),
+                  newmoov.size());
+        mediafile.seekg(layout.moov_offset + layout.moov_size);
+        copy_bytes(fs::file_size(filename) - layout.moov_offset -
+                   layout.moov_size);
+        bob.close();
+        mediafile.close();
+        if (target != outrel)
+            fs::rename(target, outrel);
+    }
+    // the layout on disk changed; reread it if written again
+    if (in_place)
+        drop_buffers();
+    return true;
+}
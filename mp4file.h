@@ -0,0 +1,76 @@
+#ifndef MP4FILE_H
+#define MP4FILE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include "audiofile.h"
+
+typedef unsigned char byte;
+extern TagMap mp4_qtags;
+
+// where the metadata sits in an MP4 file and how much free space is
+// around it, all from atom headers and the moov atom
+struct Mp4Layout
+{
+    uintmax_t moov_offset = 0;
+    uintmax_t moov_size = 0;
+    bool moov_last = false;     // only free atoms follow moov
+    bool fragmented = false;    // has moof atoms
+    bool has_ilst = false;
+    uintmax_t ilst_size = 0;
+    uintmax_t ilst_free = 0;    // free atom right after ilst inside meta
+    uintmax_t moov_free = 0;    // top-level free atom right after moov
+};
+
+Mp4Layout mp4_layout(const std::string& path);
+
+// where one covr image lies in the file; data_type is 13 for JPEG,
+// 14 for PNG and 27 for BMP
+struct Mp4Cover
+{
+    uintmax_t offset;
+    uintmax_t length;
+    uint32_t data_type;
+};
+
+std::vector<Mp4Cover> mp4_covers(const std::string& path);
+
+// whether an ilst growing (or shrinking) by delta bytes is written without
+// moving the media data, i.e. without rewriting the whole file
+bool mp4_fits_in_place(const Mp4Layout& layout, intmax_t delta);
+
+// iTunes-style metadata: moov/udta/meta/ilst. text items and trkn/disk
+// are exposed as tags keyed by atom name, anything else (cover art,
+// freeform and integer items) is carried through untouched
+class Mp4File : public AudioFile
+{
+public:
+    explicit Mp4File(std::string_view qs, FilePrefix head = FilePrefix())
+        : AudioFile(std::move(head)), filename(qs) { }
+    TagMap& get_qtags() { return QTags; }
+    TagMap get_standard() { return mp4_qtags; }
+    std::string get_filename() const { return filename; }
+    std::string get_outfile() const { return outfile; }
+    void drop_buffers();
+    size_t resident_bytes() const;
+    void strip_pictures() { strip_art = true; }
+private:
+    std::string filename;
+    std::string outfile;
+    bool strip_art = false;
+    Mp4Layout layout;
+    std::vector<std::vector<byte>> raw_items;
+    std::vector<byte> make_moov();
+    std::vector<byte> moov = make_moov();
+    TagMap make_items();
+    TagMap QTags = make_items();
+    std::vector<byte> make_ilst() const;
+
+public:
+    bool write_qtags();
+
+};
+
+#endif // MP4FILE_H
@@ -0,0 +1,238 @@
+#include <fstream>
+#include <ios>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "mpegscan.h"
+#include "payload.h"
+
+typedef unsigned char byte;
+using std::string;
+using std::vector;
+
+namespace {
+
+// kbps by [version is MPEG-1 ? 0 : 1][layer - 1][bitrate index]
+const int bitrates[2][3][16] = {
+    { { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0 },
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0 },
+      { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 } },
+    { { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 } }
+};
+const int samplerates[3] = { 44100, 48000, 32000 };
+
+struct FrameHeader
+{
+    int version;
+    int layer;
+    int bitrate;
+    int sample_rate;
+    int channels;
+    int samples;
+    int length;  // whole frame, header included
+};
+
+bool decode_header(const byte* h, FrameHeader& fh)
+{
+    if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+        return false;
+    int version_bits = (h[1] >> 3) & 3;
+    int layer_bits = (h[1] >> 1) & 3;
+    int bitrate_index = h[2] >> 4;
+    int rate_index = (h[2] >> 2) & 3;
+    if (version_bits == 1 || layer_bits == 0 || bitrate_index == 0 ||
+        bitrate_index == 15 || rate_index == 3)
+        return false;  // reserved or free-format
+    
+    fh.version = version_bits == 3 ? 10 : version_bits == 2 ? 20 : 25;
+    fh.layer = 4 - layer_bits;
+    bool mpeg1 = fh.version == 10;
+    fh.bitrate = bitrates[mpeg1 ? 0 : 1][fh.layer - 1][bitrate_index];
+    fh.sample_rate = samplerates[rate_index] / (mpeg1 ? 1 : fh.version == 20 ? 2 : 4);
+    fh.channels = (h[3] >> 6) == 3 ? 1 : 2;
+    int padding = (h[2] >> 1) & 1;
+    
+    if (fh.layer == 1)
+    {
+        fh.samples = 384;
+        fh.length = (12 * fh.bitrate * 1000 / fh.sample_rate + padding) * 4;
+    }
+    else
+    {
+        fh.samples = (fh.layer == 3 && !mpeg1) ? 576 : 1152;
+        fh.length = fh.samples / 8 * fh.bitrate * 1000 / fh.sample_rate + padding;
+    }
+    return true;
+}
+
+uint32_t be32(const byte* p)
+{
+    return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Xing/Info sits after the side information, VBRI at a fixed 32 bytes
+bool read_vbr_header(const byte* frame, size_t avail, const FrameHeader& fh,
+                     MpegInfo& info)
+{
+    size_t side = fh.version == 10 ? (fh.channels == 1 ? 17 : 32)
+                                   : (fh.channels == 1 ? 9 : 17);
+    const byte* x = frame + 4 + side;
+    if (4 + side + 16 <= avail &&
+        (std::memcmp(x, "Xing", 4) == 0 || std::memcmp(x, "Info", 4) == 0))
+    {
+        uint32_t flags = be32(x + 4);
+        if (!(flags & 1))
+            return false;  // no frame count, nothing gained
+        info.vbr = std::memcmp(x, "Xing", 4) == 0;
+        info.frames = be32(x + 8);
+        if (flags & 2)
+            info.audio_bytes = be32(x + 12);
+        return true;
+    }
+    const byte* v = frame + 4 + 32;
+    if (4 + 32 + 18 <= avail && std::memcmp(v, "VBRI", 4) == 0)
+    {
+        info.vbr = true;
+        info.audio_bytes = be32(v + 10);
+        info.frames = be32(v + 14);
+        return true;
+    }
+    return false;
+}
+
+// the first offset in buf[0, n) holding a frame whose successor also
+// decodes (or lies past n), so a stray 0xFF in leftover padding or
+// damaged audio isn't taken for a sync word; npos if there's none
+size_t find_sync(const byte* buf, size_t n, FrameHeader& first)
+{
+    for (size_t i = 0; i + 4 <= n; ++i)
+    {
+        FrameHeader next{};
+        if (!decode_header(buf + i, first))
+            continue;
+        size_t j = i + first.length;
+        if (j + 4 > n || decode_header(buf + j, next))
+            return i;
+    }
+    return string::npos;
+}
+
+}
+
+bool mpeg_frames_at(const byte* data, size_t n)
+{
+    FrameHeader fh;
+    if (n < 4 || !decode_header(data, fh))
+        return false;
+    size_t next = fh.length;
+    if (next + 4 > n)
+        return true;
+    return decode_header(data + next, fh);
+}
+
+MpegInfo scan_mpeg(const string& path, uintmax_t audio_start)
+{
+    MpegInfo info;
+    uintmax_t audio_end = audio_payload(path).end;
+    std::ifstream mediafile(path, std::ios_base::binary);
+    
+    // find the first frame whose successor also decodes, so a stray
+    // 0xFF in leftover padding isn't taken for a sync word
+    vector<byte> prefix(16384);
+    mediafile.seekg(audio_start);
+    mediafile.read(reinterpret_cast<char*>(prefix.data()), prefix.size());
+    prefix.resize(mediafile.gcount());
+    
+    FrameHeader first{};
+    size_t i = find_sync(prefix.data(), prefix.size(), first);
+    if (i == string::npos)
+        return info;
+    
+    info.valid = true;
+    info.version = first.version;
+    info.layer = first.layer;
+    info.sample_rate = first.sample_rate;
+    info.channels = first.channels;
+    
+    if (read_vbr_header(&prefix[i], prefix.size() - i, first, info))
+    {
+        info.from_header = true;
+        if (info.audio_bytes == 0)
+            info.audio_bytes = audio_end - audio_start - i;
+        info.duration = double(info.frames) * first.samples / first.sample_rate;
+        if (info.duration > 0)
+            info.bitrate = int(info.audio_bytes * 8 / info.duration / 1000);
+        return info;
+    }
+    
+    // no summary header: hop from header to header, parsing them out of
+    // 1 MB windows rather than seeking to each one. a window is refilled
+    // from the current frame once its header runs past the end
+    const size_t window_size = 1 << 20;
+    const size_t resync_span = 16384;
+    vector<byte> window;
+    uintmax_t window_start = 0;
+    auto refill = [&] (uintmax_t at)
+    {
+        window.resize(static_cast<size_t>(
+            std::min<uintmax_t>(window_size, audio_end - at)));
+        mediafile.clear();
+        mediafile.seekg(at);
+        mediafile.read(reinterpret_cast<char*>(window.data()), window.size());
+        window.resize(mediafile.gcount());
+        window_start = at;
+    };
+    
+    uintmax_t pos = audio_start + i;
+    uint64_t samples = 0;
+    int first_bitrate = first.bitrate;
+    refill(pos);
+    while (pos + 4 <= audio_end)
+    {
+        size_t at = pos - window_start;
+        if (at + 4 > window.size())
+        {
+            refill(pos);
+            if (window.size() < 4)
+                break;
+            at = 0;
+        }
+        FrameHeader fh{};
+        if (!decode_header(&window[at], fh))
+        {
+            // a damaged frame: look for the next good pair of headers
+            // further on and carry on from there, with at least
+            // resync_span bytes to search unless the audio ends first
+            if (window.size() - at < resync_span &&
+                window_start + window.size() < audio_end)
+            {
+                refill(pos);
+                if (window.size() < 4)
+                    break;
+                at = 0;
+            }
+            size_t left = window.size() - at - 1;
+            size_t found = find_sync(&window[at + 1], left, fh);
+            if (found != string::npos)
+                pos += 1 + found;
+            else if (left > 4)
+                pos += left - 2;  // a header may straddle windows
+            else
+                break;
+            continue;
+        }
+        if (fh.bitrate != first_bitrate)
+            info.vbr = true;
+        ++info.frames;
+        samples += fh.samples;
+        info.audio_bytes += fh.length;
+        pos += fh.length;
+    }
+    info.duration = double(samples) / first.sample_rate;
+    if (info.duration > 0)
+        info.bitrate = int(info.audio_bytes * 8 / info.duration / 1000);
+    return info;
+}
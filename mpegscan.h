@@ -0,0 +1,33 @@
+#ifndef MPEGSCAN_H
+#define MPEGSCAN_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+struct MpegInfo
+{
+    bool valid = false;
+    int version = 0;      // 10 = MPEG-1, 20 = MPEG-2, 25 = MPEG-2.5
+    int layer = 0;
+    int sample_rate = 0;
+    int channels = 0;
+    bool vbr = false;
+    bool from_header = false;  // totals came from a Xing/Info/VBRI header
+    uint64_t frames = 0;
+    uint64_t audio_bytes = 0;
+    double duration = 0;  // seconds
+    int bitrate = 0;      // average, kbps
+};
+
+// reads the MPEG audio starting at audio_start (just past the ID3v2 tag).
+// a Xing/Info/VBRI header in the first frame answers everything from a
+// few KB; otherwise the frame headers are walked, skipping frame bodies
+// and resyncing past any damaged ones
+MpegInfo scan_mpeg(const std::string& path, uintmax_t audio_start);
+
+// whether data starts with an MPEG audio frame header and, if the frame
+// ends within n bytes, another header right after it
+bool mpeg_frames_at(const unsigned char* data, size_t n);
+
+#endif // MPEGSCAN_H
@@ -10,11 +10,12 @@
 #include <cstddef>
 #include <stdexcept>
 #include <filesystem>
-#include <QDebug>
-#include <QString>
-#include <QMessageBox>
-#include <QApplication>
+#include <utility>
+#include <cctype>
+#include <set>
 #include "musfile.h"
+#include "fileio.h"
+#include "id3codec.h"
 
 typedef unsigned char byte;
 using std::vector;
@@ -22,10 +23,213 @@ using std::string;
 using std::map;
 namespace fs = std::filesystem;
 
+// the 2.3 name of a 2.2 frame, so 2.2 tags read (and get rewritten) as 2.3
+static string v22_frame_id(const string& id)
+{
+    static const map<string, string> names{
+        {"BUF", "RBUF"}, {"COM", "COMM"}, {"IPL", "IPLS"}, {"PIC", "APIC"},
+        {"TAL", "TALB"}, {"TBP", "TBPM"}, {"TCM", "TCOM"}, {"TCO", "TCON"},
+        {"TCR", "TCOP"}, {"TDA", "TDAT"}, {"TEN", "TENC"}, {"TLA", "TLAN"},
+        {"TLE", "TLEN"}, {"TOA", "TOPE"}, {"TOT", "TOAL"}, {"TP1", "TPE1"},
+        {"TP2", "TPE2"}, {"TP3", "TPE3"}, {"TP4", "TPE4"}, {"TPA", "TPOS"},
+        {"TPB", "TPUB"}, {"TRC", "TSRC"}, {"TRK", "TRCK"}, {"TT1", "TIT1"},
+        {"TT2", "TIT2"}, {"TT3", "TIT3"}, {"TXT", "TEXT"}, {"TXX", "TXXX"},
+        {"TYE", "TYER"}, {"ULT", "USLT"}, {"WXX", "WXXX"} };
+    auto it = names.find(id);
+    return it != names.end() ? it->second : id;
+}
+
+// frames QTags can hold as a single value per id: the plain text frames,
+// and a COMM (see in_qtags). TXXX is a description and value pair, any
+// number of them, so like APIC it stays on disk and a write reads it back
+static bool is_text_frame(const string& id)
+{
+    return (id[0] == 'T' && id != "TXXX") || id == "COMM";
+}
+
+static void append_utf8(string& out, uint32_t cp)
+{
+    if (cp < 0x80)
+        out += static_cast<char>(cp);
+    else if (cp < 0x800)
+    {
+        out += static_cast<char>(0xC0 | cp >> 6);
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        out += static_cast<char>(0xE0 | cp >> 12);
+        out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        out += static_cast<char>(0xF0 | cp >> 18);
+        out += static_cast<char>(0x80 | (cp >> 12 & 0x3F));
+        out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+// UTF-16 text starting at p, big endian unless a byte order mark says
+// otherwise; each string of a list may carry its own. strings end at a 0
+// unit and go in strings. a lone surrogate becomes U+FFFD
+static void decode_utf16(const byte* p, size_t n, bool big_endian,
+                         vector<string>& strings)
+{
+    string text;
+    for (size_t i = 0; i + 1 < n; i += 2)
+    {
+        uint32_t unit = big_endian ? p[i] << 8 | p[i + 1] : p[i] | p[i + 1] << 8;
+        if (unit == 0xFEFF || unit == 0xFFFE)
+        {
+            if (unit == 0xFFFE)
+                big_endian = !big_endian;
+            continue;
+        }
+        if (unit == 0)
+        {
+            strings.push_back(std::move(text));
+            text.clear();
+            continue;
+        }
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 3 < n)
+        {
+            uint32_t low = big_endian ? p[i + 2] << 8 | p[i + 3]
+                                      : p[i + 2] | p[i + 3] << 8;
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                append_utf8(text, 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00));
+                i += 2;
+                continue;
+            }
+        }
+        append_utf8(text, unit >= 0xD800 && unit < 0xE000 ? 0xFFFD : unit);
+    }
+    strings.push_back(std::move(text));
+}
+
+// the strings of a text frame's body as UTF-8: its encoding byte says
+// Latin-1 (0), UTF-16 with a byte order mark (1), UTF-16BE (2) or UTF-8
+// (3). a COMM's language is skipped, so its description comes first
+static vector<string> decode_strings(const string& id, const byte* p, size_t n)
+{
+    vector<string> strings;
+    size_t skip = id == "COMM" ? 4 : 1;  // encoding, language
+    if (n < skip)
+        return strings;
+    byte encoding = p[0];
+    p += skip;
+    n -= skip;
+    if (encoding == 1 || encoding == 2)
+        decode_utf16(p, n, encoding == 2, strings);
+    else
+    {
+        string text;
+        for (size_t i = 0; i != n; ++i)
+            if (p[i] == 0)
+            {
+                strings.push_back(std::move(text));
+                text.clear();
+            }
+            else
+                text += static_cast<char>(p[i]);
+        strings.push_back(std::move(text));
+        if (encoding == 0)
+            for (auto& str : strings)
+                str = latin1_to_utf8(str);
+    }
+    return strings;
+}
+
+// a text frame's value: a COMM's text, without its description; other
+// frames' lists of strings (2.4) joined with '/'
+static string decode_text(const string& id, const byte* p, size_t n)
+{
+    vector<string> strings = decode_strings(id, p, n);
+    if (strings.empty())
+        return string();
+    if (id == "COMM")
+        return strings.size() > 1 ? strings[1] : strings[0];
+    string ret;
+    for (const auto& str : strings)
+        if (!str.empty())
+            ret += (ret.empty() ? "" : "/") + str;
+    return ret;
+}
+
+// value as UTF-16 code units, pairs of surrogates above U+FFFF. a byte
+// that isn't UTF-8 is taken as Latin-1, as decode_text would have read it
+static std::u16string to_utf16(const string& value)
+{
+    std::u16string ret;
+    for (size_t i = 0; i != value.size(); )
+    {
+        byte b = static_cast<byte>(value[i]);
+        size_t len = b < 0x80 ? 1 : (b & 0xE0) == 0xC0 ? 2
+                   : (b & 0xF0) == 0xE0 ? 3 : (b & 0xF8) == 0xF0 ? 4 : 0;
+        bool valid = len != 0 && i + len <= value.size();
+        uint32_t cp = len == 1 ? b : b & (0x3F >> (len - 1));
+        for (size_t k = 1; valid && k != len; ++k)
+        {
+            byte cont = static_cast<byte>(value[i + k]);
+            valid = (cont & 0xC0) == 0x80;
+            cp = cp << 6 | (cont & 0x3F);
+        }
+        if (!valid)
+        {
+            cp = b;
+            len = 1;
+        }
+        if (cp >= 0x10000)
+        {
+            ret += static_cast<char16_t>(0xD800 + ((cp - 0x10000) >> 10));
+            ret += static_cast<char16_t>(0xDC00 + ((cp - 0x10000) & 0x3FF));
+        }
+        else
+            ret += static_cast<char16_t>(cp);
+        i += len;
+    }
+    return ret;
+}
+
+// the body put_frames writes for a text frame: encoding 1 (UTF-16 with a
+// byte order mark, good in every version), little endian. a COMM gets
+// language "eng" and an empty description ahead of the text
+static vector<byte> text_body(const string& id, const string& value)
+{
+    vector<byte> ret{ 0x01 };
+    if (id == "COMM")
+        ret.insert(ret.end(), { 'e', 'n', 'g', 0xFF, 0xFE, 0x00, 0x00 });
+    ret.insert(ret.end(), { 0xFF, 0xFE });
+    for (char16_t unit : to_utf16(value))
+    {
+        ret.push_back(static_cast<byte>(unit & 0xFF));
+        ret.push_back(static_cast<byte>(unit >> 8));
+    }
+    return ret;
+}
+
+// a 2.2 PIC has a three letter image format where APIC has a MIME type
+static vector<byte> v22_picture(const vector<byte>& body)
+{
+    if (body.size() < 4)
+        return body;
+    string format(body.begin() + 1, body.begin() + 4);
+    for (auto& ch : format)
+        ch = static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+    string mime = format == "jpg" ? "image/jpeg" : "image/" + format;
+    vector<byte> ret{ body[0] };
+    ret.insert(ret.end(), mime.begin(), mime.end());
+    ret.push_back(0);
+    ret.insert(ret.end(), body.begin() + 4, body.end());
+    return ret;
+}
+
 vector<byte> MusFile::make_filebytes()
 {
-    std::ifstream mediafile{ filename.toStdString(), 
-                             std::ios_base::binary };
+    tail = read_tail(filename, prefix);
+    PrefixedFile mediafile(filename, std::exchange(prefix, FilePrefix()));
     noskipws(mediafile);
     std::istream_iterator<byte> infile{mediafile}, eof;
     
@@ -33,47 +237,69 @@ vector<byte> MusFile::make_filebytes()
     std::copy_n(infile, 10, std::back_inserter(ret));
     ++infile;
     
+    auto fsize = fs::file_size(fs::path(filename));
+    has_id3v2 = ret[0] == 'I' && ret[1] == 'D' && ret[2] == '3';
+    if (!has_id3v2)
+    {
+        // whatever tags there are live in the tail, the head is all audio
+        id3_orig = 0;
+        remaining_filesize = fsize;
+        return ret;
+    }
+    
     // ID3 header size bytes(4) begin after "ID3", two version bytes, and 
     // one flag byte. size bytes ignore most significant bit of each byte.
-    size_t id3_length = ret[6] * pow(2, 21) + ret[7] * pow(2, 14) +
-        ret[8] * pow(2, 7) + ret[9] * (1);
-    std::copy_n(infile, static_cast<__int64>(id3_length), 
+    id3_version = ret[3];
+    size_t id3_length = TagSizeCodec::decode(&ret[6]);
+    std::copy_n(infile, id3_length, 
                         std::back_inserter(ret));
     id3_orig = id3_length;
-    auto fsize = fs::file_size(fs::path(filename.toStdString()));
-    remaining_filesize = fsize - id3_length - 128;
+    audio_offset = id3_tag_extent(ret.data());
+    remaining_filesize = fsize - audio_offset; // audio through EOF
     return ret;
 }
 
-vector<byte> MusFile::get_tag()
+template <int Version>
+vector<vector<byte>> MusFile::read_frames()
 {
-    // get 4-byte int(BE) for tag size 
-    int tagsize = int( filepos[4] << 24 | filepos[5] << 16 |
-                       filepos[6] << 8  | filepos[7] );
-    if (tagsize == 0)
-        return vector<byte>();
-    vector<byte> ret;
-    ret.reserve(tagsize+10);  // ten bytes for tag header
-    ret.assign(filepos, filepos+tagsize+10);
+    typedef Id3Frame<Version> Frame;
+    vector<vector<byte>> ret;
+    const byte* end = tagbytes.data() + tagbytes.size();
+    const byte* p = tagbytes.data() + (filepos - tagbytes.begin());
+    // a tag without padding ends right after its last frame
+    uint32_t body_size = 0;
+    while (Frame::read(p, end - p, body_size))
+    {
+        ret.emplace_back(p, p + Frame::header_size + body_size);
+        p += Frame::header_size + body_size;
+    }
+    filepos = tagbytes.begin() + (p - tagbytes.data());
     return ret;
 }
 
-
-
-
 vector<vector<byte>> MusFile::maketags()
 {
     vector<vector<byte>> ret;
-    vector<byte> next_tag{1}; // initial value just so it's not empty
-    while (!next_tag.empty())
-    { 
-        next_tag = get_tag();
-        if (!next_tag.empty())
-        { 
-            filepos += next_tag.size();
-            ret.reserve(next_tag.size());
-            ret.push_back(next_tag);
-        }
+    if (!has_id3v2)
+    {
+        if (!tail.has_v1)
+            throw std::runtime_error("No ID3 tags found in file");
+        return ret;  // make_qtags falls back to the v1 tag
+    }
+    switch (id3_version)
+    {
+    case 2:
+        ret = read_frames<2>();
+        break;
+    case 3:
+        ret = read_frames<3>();
+        break;
+    case 4:
+        ret = read_frames<4>();
+        break;
+    default:
+        throw std::runtime_error("Unsupported ID3v2 version 2." +
+                                 std::to_string(id3_version));
     }
     if (ret.size() == 0)
         throw std::runtime_error("No tags ID3v2 tags found in file");
@@ -84,192 +310,267 @@ vector<vector<byte>> MusFile::maketags()
 
 
 
-std::vector<byte> MusFile::get_id3_size(int i)
-{  
-    if (i <= 127) // 7 places max value
-        return std::vector<byte>({0,0,0,static_cast<byte>(i)});
-    else if (i <= 16383) // 14 places max
-    {
-        auto i2 = i;
-        auto byte1 = static_cast<byte>(i2 & 127);
-        i2 = i; 
-        auto byte2 = static_cast<byte>((i2 & 16256) >> 7); 
-        return std::vector<byte>({0,0,byte2,byte1});
-    }
-    else if (i <= 2097151) // 21 places max
+vector<bool> MusFile::in_qtags() const
+{
+    // one frame per id: a repeat, which QTags has no room for, is carried
+    // over as it is. of the COMMs only one with no description is taken,
+    // since a write gives it an empty one; the rest (iTunNORM and the
+    // like) are carried over too
+    vector<bool> ret(bintags.size(), false);
+    std::set<string> seen;
+    const Id3FrameShape shape = id3_frame_shape(id3_version);
+    for (size_t i = 0; i != bintags.size(); ++i)
     {
-        auto i2 = i;
-        auto byte1 = static_cast<byte>(i2 & 127);
-        i2 = i;
-        auto byte2 = static_cast<byte>((i2 & 16256) >> 7);
-        i2 = i;
-        auto byte3 = static_cast<byte>((i2 & 2080768) >> 14);
-        return std::vector<byte>({ 0,byte3,byte2,byte1 });
+        string id(bintags[i].begin(), bintags[i].begin() + shape.id_size);
+        if (id3_version == 2)
+            id = v22_frame_id(id);
+        if (!is_text_frame(id) || seen.count(id) != 0)
+            continue;
+        if (id == "COMM")
+        {
+            auto strings = decode_strings(id, bintags[i].data() + shape.header_size,
+                                          bintags[i].size() - shape.header_size);
+            if (strings.empty() || !strings[0].empty())
+                continue;
+        }
+        seen.insert(id);
+        ret[i] = true;
     }
-    else
-        throw std::out_of_range("ID3 header too large");
-        // it could technically be larger (28 significant bits), but 
-        // something most likely went wrong if the header is that large
+    return ret;
 }
 
-std::map<QString, QString> MusFile::make_qtags()
+TagMap MusFile::make_qtags()
 {
     // go straight from bintags, which is a vector of byte vectors,
-    // to qtags, a map of QString, QString pairs
-    map<QString, QString> tagmap;
-    for (int i = 0; i != bintags.size(); ++i)
+    // to qtags, a map of tag type, UTF-8 text pairs
+    TagMap tagmap;
+    const Id3FrameShape shape = id3_frame_shape(id3_version);
+    vector<bool> taken = in_qtags();
+    for (size_t i = 0; i != bintags.size(); ++i)
     {
-        string tagtype;
-        string tag;
-        for (int j = 0; j != 4; ++j)
-            tagtype.push_back(bintags[i][j]);
-        
-
-        for (int j = 10; j != bintags[i].size(); ++j)
-        {
-            if (bintags[i][j] == 1)
-            {
-                // 1 indicates UTF-16, FF FE for little endian
-                j += 2; // skip three bytes, two and then
-                continue; // this one
-            }
-            else if (bintags[i][j] == 255)
-            {
-                // stray byte order mark not at beginning of tag
-                j+= 1; // skip two bytes, one and then
-                continue; // this one
-            }
-            else if (bintags[i][j] == 0)
-                continue; // also skip zero padding
-            tag.push_back(bintags[i][j]);
-        }
-        tagmap.insert({ QString::fromStdString(tagtype),
-                        QString::fromStdString(tag) });
+        if (!taken[i])
+            continue;
+        string tagtype(bintags[i].begin(), bintags[i].begin() + shape.id_size);
+        string tag = decode_text(id3_version == 2 ? v22_frame_id(tagtype) : tagtype,
+                                 bintags[i].data() + shape.header_size,
+                                 bintags[i].size() - shape.header_size);
+        tagmap.insert({ tagtype, tag });
+    }
+    if (id3_version == 2)
+    {
+        TagMap renamed;
+        for (auto& p : tagmap)
+            renamed.insert({ v22_frame_id(p.first), std::move(p.second) });
+        tagmap.swap(renamed);
+    }
+    if (bintags.empty() && tail.has_v1)
+    {
+        const Id3v1Tag& v1 = tail.v1;
+        for (const auto& p : { std::pair<const char*, string>
+                               {"TIT2", v1.title}, {"TPE1", v1.artist},
+                               {"TALB", v1.album}, {"TYER", v1.year},
+                               {"COMM", v1.comment} })
+            if (!p.second.empty())
+                tagmap.insert({ p.first, p.second });
+        if (v1.track != 0)
+            tagmap.insert({ "TRCK", std::to_string(v1.track) });
+        if (v1.genre != 255)
+            tagmap.insert({ "TCON", "(" + std::to_string(v1.genre) + ")" });
     }
     return tagmap;    
 } 
 
 
 
+vector<std::pair<string, vector<byte>>> MusFile::binary_frames()
+{
+    vector<std::pair<string, vector<byte>>> ret;
+    if (!has_id3v2)
+        return ret;
+    bool reloaded = bintags.empty();
+    if (reloaded)  // let go by drop_buffers, so read the tag again
+    {
+        tagbytes = make_filebytes();
+        filepos = tagbytes.begin() + 10;
+        bintags = maketags();
+    }
+    const Id3FrameShape shape = id3_frame_shape(id3_version);
+    vector<bool> taken = in_qtags();
+    for (size_t i = 0; i != bintags.size(); ++i)
+    {
+        const auto& frame = bintags[i];
+        string id(frame.begin(), frame.begin() + shape.id_size);
+        if (id3_version == 2)
+            id = v22_frame_id(id);
+        // a 2.2 frame with no 2.3 name can't be carried over
+        if (taken[i] || id.size() != 4 || (strip_art && id == "APIC"))
+            continue;
+        vector<byte> body(frame.begin() + shape.header_size, frame.end());
+        if (id3_version == 2 && id == "APIC")
+            body = v22_picture(body);
+        ret.push_back({ id, std::move(body) });
+    }
+    if (reloaded)
+        drop_buffers();
+    return ret;
+}
+
+void MusFile::drop_buffers()
+{
+    // write_qtags only needs QTags and the sizes, and reads any binary
+    // frames back from disk, so the raw tag can go entirely; swap with
+    // empties to actually release capacity
+    vector<byte>().swap(tagbytes);
+    vector<vector<byte>>().swap(bintags);
+    filepos = tagbytes.begin();
+}
+
+size_t MusFile::resident_bytes() const
+{
+    size_t total = tagbytes.capacity();
+    for (const auto& tag : bintags)
+        total += tag.capacity();
+    for (const auto& p : QTags)
+        total += p.first.capacity() + p.second.capacity();
+    return total;
+}
+
+void MusFile::write_v1_tail(const string& outrel)
+{
+    // the rewrite copies the old tail verbatim, so either way the v1
+    // tag is the last 128 bytes of outrel and is updated where it sits
+    if (!tail.has_v1)
+        return;
+    Id3v1Tag v1 = tail.v1;
+    auto take = [this] (const char* key, string& field)
+        { if (QTags.count(key) != 0) field = QTags.at(key); };
+    take("TIT2", v1.title);
+    take("TPE1", v1.artist);
+    take("TALB", v1.album);
+    take("TYER", v1.year);
+    take("COMM", v1.comment);
+    if (QTags.count("TRCK") != 0)
+        v1.track = std::atoi(QTags.at("TRCK").c_str());
+    if (QTags.count("TCON") != 0)
+        v1.genre = id3v1_genre(QTags.at("TCON"));
+    write_id3v1(outrel, v1);
+}
+
+// each value as a UTF-16 text frame, then the binary frames as they
+// were, headers laid out for Version
+template <int Version>
+static void put_frames(std::ostream& os, const TagMap& tags,
+                       const vector<std::pair<string, vector<byte>>>& binary)
+{
+    typedef Id3Frame<Version> Frame;
+    byte header[Frame::header_size];
+    for (const auto& p : tags)
+    {
+        vector<byte> body = text_body(p.first, p.second);
+        if (body.size() > Frame::Size::max)
+            throw std::out_of_range("ID3 frame too big: " + p.first);
+        Frame::write(header, p.first.data(), static_cast<uint32_t>(body.size()));
+        os.write(reinterpret_cast<const char*>(header), sizeof header);
+        os.write(reinterpret_cast<const char*>(body.data()), body.size());
+    }
+    for (const auto& frame : binary)
+    {
+        if (frame.second.size() > Frame::Size::max)
+            throw std::out_of_range("ID3 frame too big: " + frame.first);
+        Frame::write(header, frame.first.data(),
+                     static_cast<uint32_t>(frame.second.size()));
+        os.write(reinterpret_cast<const char*>(header), sizeof header);
+        os.write(reinterpret_cast<const char*>(frame.second.data()),
+                 frame.second.size());
+    }
+}
+
 bool MusFile::write_qtags()
 {
     
-    int tagsum = 0;
-    for(const auto& p : QTags)
-        tagsum+= 10 + 3 + (p.second.size() * 2);
-        // tag type (4) + ( tag length * 2(zeroes) ) + 3 (BOM) + 2 (flags) 
-    // add back in zeroes and encoding-type byte + order mark (2 bytes)
+    // sizes below assume four character frame ids, refuse anything else
+    // (e.g. a Vorbis field name) before touching a file
+    for (const auto& p : QTags)
+        if (p.first.size() != 4)
+            throw std::invalid_argument("Not an ID3v2 frame id: " + p.first);
     
+    size_t tagsum = 0;
+    for(const auto& p : QTags)
+        tagsum += 10 + text_body(p.first, p.second).size();
+        // frame header, then the body put_frames writes
+    auto binary = binary_frames();
+    for (const auto& frame : binary)
+        tagsum += 10 + frame.second.size();
+    if (tagsum > TagSizeCodec::max)
+        throw std::out_of_range("ID3 header too large");
     
-    auto mp3path = fs::path(filename.toStdString());
-    string outname = mp3path.filename().string();
-    string filedir = QTags.at("TALB").toStdString();
     
-    // replace forbidden characters for directory with a space
-    string no_dir_chars = ">:\"/\\|?*";
-    if (filedir.find_first_of(no_dir_chars) != string::npos)
-        for (const auto& ch : no_dir_chars)
-        {   
-            auto index = filedir.find(ch);
-            if (index != string::npos)
-                filedir[index] = ' ';
-        }
-    
-    string outrel = filedir + "\\" + outname;
-    fs::create_directories(filedir);
+    auto mp3path = fs::path(filename);
+    string outrel = filename;
+    if (!in_place)  // write a copy into a directory named for the album
+    {
+        string outname = mp3path.filename().string();
+        string filedir = QTags.at("TALB");
+        
+        // replace forbidden characters for directory with a space
+        string no_dir_chars = ">:\"/\\|?*";
+        if (filedir.find_first_of(no_dir_chars) != string::npos)
+            for (const auto& ch : no_dir_chars)
+            {   
+                auto index = filedir.find(ch);
+                if (index != string::npos)
+                    filedir[index] = ' ';
+            }
+        
+        outrel = filedir + "\\" + outname;
+        fs::create_directories(filedir);
+    }
+    outfile = outrel;
     
-    if (id3_orig >= tagsum)  // overwrite id3 header, maintain size
+    // stripping artwork only pays off if the header actually shrinks.
+    // a 2.2 tag has shorter frame headers, so it's always rewritten as 2.3
+    if (id3_orig >= tagsum && !strip_art && id3_version >= 3)  // overwrite id3 header, maintain size
     {
-        fs::copy(mp3path, outrel);
+        if (!in_place)
+            clone_file(filename, outrel);
         std::fstream biob(outrel, std::ios_base::binary
                           | std::ios_base::out | std::ios_base::in);
         biob.seekp(10, std::ios_base::beg);
         
-        for (const auto& p : QTags)
-        {
-            for (const auto& ch : p.first.toStdString())
-                biob << ch;
-            
-            // four size bytes
-            size_t size = (p.second.size() * 2) + 3;
-            if (size <= 255)
-            {
-                biob << byte(0x00)<< byte(0x00)<< byte(0x00);
-                biob << static_cast<byte>(size);
-            }
-            else if (size <= 65535)
-            {
-                biob << byte(0x00)<< byte(0x00);
-                biob << static_cast<byte>(size >> 8) << byte(0xFF);
-            }
-            else 
-                throw std::out_of_range("ID3 tag too big");
-                // again, if it's that big there's something wrong
-            
-            biob << byte(0x00) << byte(0x00); // two flag bytes
-            biob << byte(0x01) << byte(0xFF) << byte(0xFE); // UTF-16LE
-            for (const auto& ch : p.second.toStdString())
-            {
-                biob << ch;
-                biob << byte(0x00);
-            }    
-        }
+        // frames go back in the version the tag header already declares
+        if (id3_version == 4)
+            put_frames<4>(biob, QTags, binary);
+        else
+            put_frames<3>(biob, QTags, binary);
         
         auto size_difference = id3_orig - tagsum;
         for (int i = 0; i != size_difference; ++i)
             biob << byte(0x00);
-        biob.seekp(128, std::ios_base::end);
-        for (int i = 0; i != 127; ++i)
-            biob << byte(0x00);
-        biob << byte(0xFF);
+        biob.close();
+        write_v1_tail(outrel);
         return true;
     }
     else  // not enough space for new ID3 header, rewrite entire file
     {
+        // in place, build the new file beside the original and swap it
+        // in afterwards, since the audio is still read from the original
+        string target = in_place ? outrel + ".tagtmp" : outrel;
         // binary out bucket -- bob
-        std::ofstream bob(outrel, std::ios_base::binary);
+        std::ofstream bob(target, std::ios_base::binary);
         
         bob << 'I' << 'D' << '3' << byte(0x03) << byte(0x00)
             << byte(0x00); // "ID3" and version bytes (ID3v2.3.0)
         // add up all the sizes of the tags and pass result to get_id3_size
     
-        auto sizebytes = get_id3_size(tagsum);
-        for (const auto& ch : sizebytes)
-            bob << ch;
-        for (const auto& p : QTags)
-        {
-            for (const auto& ch : p.first.toStdString())
-                bob << ch;
-            
-            // four size bytes
-            size_t size = (p.second.size() * 2) + 3;
-            if (size <= 255)
-            {
-                bob << byte(0x00)<< byte(0x00)<< byte(0x00);
-                bob << static_cast<byte>(size);
-            }
-            else if (size <= 65535)
-            {
-                bob << byte(0x00)<< byte(0x00);
-                bob << static_cast<byte>(size >> 8) << byte(0xFF);
-            }
-            else 
-                throw std::out_of_range("ID3 tag too big");
-                // again, if it's that big there's something wrong
-            
-            bob << byte(0x00) << byte(0x00); // two flag bytes
-            bob << byte(0x01) << byte(0xFF) << byte(0xFE); // UTF-16LE
-            for (const auto& ch : p.second.toStdString())
-            {
-                bob << ch;
-                bob << byte(0x00);
-            }    
-        }
+        byte sizebytes[4];
+        TagSizeCodec::encode(static_cast<uint32_t>(tagsum), sizebytes);
+        bob.write(reinterpret_cast<const char*>(sizebytes), 4);
+        put_frames<3>(bob, QTags, binary);
         
-        std::ifstream mediafile{ filename.toStdString(), 
+        std::ifstream mediafile{ filename, 
                                  std::ios_base::binary };
         noskipws(mediafile);
-        mediafile.ignore(id3_orig+10); // position after original header
+        mediafile.ignore(audio_start()); // position after original header
         
         std::vector<char> filebucket;
         filebucket.reserve(remaining_filesize);
@@ -277,15 +578,11 @@ bool MusFile::write_qtags()
         
         mediafile.read(filebucket.data(), filebucket.size());
         bob.write(filebucket.data(), filebucket.size());
-        
-        vector<char> zeroes;
-        zeroes.reserve(127);
-        zeroes.assign(127, 0);
-        
-        bob.seekp(128, std::ios_base::end);
-        bob.write(zeroes.data(), 127);
-        bob << byte(0xFF);
-
+        bob.close();
+        mediafile.close();
+        if (target != outrel)
+            fs::rename(target, outrel);
+        write_v1_tail(outrel);
         return true;
     }
 }
@@ -10,39 +10,58 @@
 #include <cmath>
 #include <cstddef>
 #include <map>
-#include <QString>
-#include <QLineEdit>
-#include <QProgressBar>
+#include <string_view>
 
 #include "audiofile.h"
-extern std::map<QString, QString> standard_qtags;
+#include "mpegscan.h"
+#include "id3v1.h"
+extern TagMap standard_qtags;
 
 
 class MusFile : public AudioFile
 {
 public:
     typedef unsigned char byte;
-    explicit MusFile(const QString& s)
-        : AudioFile(), filename(s) { }
+    explicit MusFile(std::string_view s, FilePrefix head = FilePrefix())
+        : AudioFile(std::move(head)), filename(s) { }
     const std::vector<std::vector<byte>> 
          show_bintags() const { return bintags; }
-    std::map<QString, QString>& get_qtags() { return QTags; }
-    std::map<QString, QString> get_standard() { return standard_qtags; }
+    TagMap& get_qtags() { return QTags; }
+    TagMap get_standard() { return standard_qtags; }
+    std::string get_filename() const { return filename; }
+    std::string get_outfile() const { return outfile; }
+    void drop_buffers();
+    size_t resident_bytes() const;
+    MpegInfo audio_info() const
+        { return scan_mpeg(filename, audio_start()); }
+    void strip_pictures() { strip_art = true; }
 
 private:
-    QString filename;
+    std::string filename;
+    std::string outfile;
     size_t id3_orig;
     uintmax_t remaining_filesize;
+    bool strip_art = false;
+    bool has_id3v2 = false;
+    int id3_version = 0;  // major version, 2 to 4
+    TailInfo tail;
+    uintmax_t audio_offset = 0;  // past the tag, and its footer if any
+    uintmax_t audio_start() const { return audio_offset; }
+    void write_v1_tail(const std::string& outrel);
     std::vector<byte> make_filebytes();
     std::vector<byte> tagbytes = make_filebytes();
     std::vector<byte>::iterator filepos = tagbytes.begin() + 10;
-    std::vector<byte> get_tag(); 
+    template <int Version> std::vector<std::vector<byte>> read_frames();
     std::vector<std::vector<byte>> maketags();
     std::vector<std::vector<byte>> bintags = maketags();
-    std::vector<byte> get_id3_size(int);
-    std::map<QString, QString> make_qtags();
+    // which of bintags make_qtags decodes; binary_frames carries the rest
+    std::vector<bool> in_qtags() const;
+    TagMap make_qtags();
+    // the frames (id, body) a write carries over as they were, read back from
+    // the file if drop_buffers let them go
+    std::vector<std::pair<std::string, std::vector<byte>>> binary_frames();
 public:  
-    std::map<QString, QString> QTags = make_qtags();
+    TagMap QTags = make_qtags();
     bool write_qtags();
 };
 
@@ -0,0 +1,370 @@
+#include <vector>
+#include <fstream>
+#include <ios>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include "oggfile.h"
+#include "vcomment.h"
+#include "fileio.h"
+
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+static const uint32_t (&ogg_crc_tables())[8][256]
+{
+    static uint32_t tables[8][256];
+    static bool filled = [] {
+        for (uint32_t i = 0; i != 256; ++i)
+        {
+            uint32_t crc = i << 24;
+            for (int j = 0; j != 8; ++j)
+                crc = (crc << 1) ^ (0x04C11DB7 & (0 - (crc >> 31)));
+            tables[0][i] = crc;
+        }
+        for (uint32_t i = 0; i != 256; ++i)
+            for (int t = 1; t != 8; ++t)
+                tables[t][i] = (tables[t - 1][i] << 8) ^
+                               tables[0][tables[t - 1][i] >> 24];
+        return true;
+    }();
+    (void)filled;
+    return tables;
+}
+
+uint32_t ogg_crc(uint32_t crc, const byte* data, size_t n)
+{
+    const auto& t = ogg_crc_tables();
+    for (; n >= 8; n -= 8, data += 8)
+    {
+        uint32_t hi = crc ^ (uint32_t(data[0]) << 24 | data[1] << 16 |
+                             data[2] << 8 | data[3]);
+        crc = t[7][hi >> 24] ^ t[6][(hi >> 16) & 0xFF] ^
+              t[5][(hi >> 8) & 0xFF] ^ t[4][hi & 0xFF] ^
+              t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (; n != 0; --n)
+        crc = (crc << 8) ^ t[0][(crc >> 24) ^ *data++];
+    return crc;
+}
+
+static uint32_t get_4le(const byte* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+static void set_4le(byte* p, uint32_t v)
+{
+    for (int i = 0; i != 4; ++i)
+        p[i] = (v >> (8 * i)) & 255;
+}
+
+// one whole page, header and lacing table included; false at end of file
+static bool read_page(std::istream& in, vector<byte>& page)
+{
+    page.resize(27);
+    in.read(reinterpret_cast<char*>(page.data()), 27);
+    if (in.gcount() == 0)
+        return false;
+    if (in.gcount() != 27 || std::memcmp(page.data(), "OggS", 4) != 0)
+        throw std::runtime_error("Bad Ogg page");
+    size_t segments = page[26];
+    page.resize(27 + segments);
+    in.read(reinterpret_cast<char*>(page.data() + 27), segments);
+    size_t body = 0;
+    for (size_t i = 0; i != segments; ++i)
+        body += page[27 + i];
+    page.resize(27 + segments + body);
+    in.read(reinterpret_cast<char*>(page.data() + 27 + segments), body);
+    if (static_cast<size_t>(in.gcount()) != body)
+        throw std::runtime_error("Truncated Ogg page");
+    return true;
+}
+
+// Vorbis has identification, comment and setup headers, Opus only the
+// first two
+static size_t header_packet_count(const vector<byte>& first_page)
+{
+    const byte* body = first_page.data() + 27 + first_page[26];
+    size_t len = first_page.size() - 27 - first_page[26];
+    if (len >= 7 && std::memcmp(body, "\x01vorbis", 7) == 0)
+        return 3;
+    if (len >= 8 && std::memcmp(body, "OpusHead", 8) == 0)
+        return 2;
+    throw std::runtime_error("Unsupported Ogg codec");
+}
+
+uintmax_t ogg_audio_start(const string& path)
+{
+    std::ifstream mediafile(path, std::ios_base::binary);
+    vector<byte> page;
+    if (!read_page(mediafile, page))
+        throw std::runtime_error("Empty Ogg file " + path);
+    uint32_t serial = get_4le(&page[14]);
+    size_t needed = header_packet_count(page);
+    uintmax_t pos = page.size();
+    size_t packets = 1;  // the identification header
+    while (read_page(mediafile, page))
+    {
+        pos += page.size();
+        if (get_4le(&page[14]) != serial)
+            continue;
+        for (size_t i = 0; i != page[26]; ++i)
+            packets += page[27 + i] < 255;
+        if (packets >= needed)
+            return pos;
+    }
+    throw std::runtime_error("Truncated Ogg headers in " + path);
+}
+
+void copy_ogg_pages(std::istream& in, std::ostream& out, uint32_t serial,
+                    uint32_t seq_delta)
+{
+    vector<byte> page;
+    while (read_page(in, page))
+    {
+        if (get_4le(&page[14]) == serial)
+        {
+            set_4le(&page[18], get_4le(&page[18]) + seq_delta);
+            set_4le(&page[22], 0);
+            set_4le(&page[22], ogg_crc(0, page.data(), page.size()));
+        }
+        out.write(reinterpret_cast<const char*>(page.data()), page.size());
+    }
+}
+
+void ogg_last_page(const byte* data, size_t n, uint32_t& serial,
+                   uint32_t& seqno)
+{
+    size_t pos = 0;
+    while (pos + 27 <= n && std::memcmp(data + pos, "OggS", 4) == 0)
+    {
+        serial = get_4le(data + pos + 14);
+        seqno = get_4le(data + pos + 18);
+        size_t segments = data[pos + 26];
+        if (pos + 27 + segments > n)
+            break;
+        size_t body = 0;
+        for (size_t i = 0; i != segments; ++i)
+            body += data[pos + 27 + i];
+        pos += 27 + segments + body;
+    }
+    if (pos != n)
+        throw std::runtime_error("Not a run of whole Ogg pages");
+}
+
+vector<vector<byte>> OggFile::make_packets()
+{
+    PrefixedFile mediafile(filename, std::exchange(prefix, FilePrefix()));
+    vector<byte> page;
+    if (!read_page(mediafile, page))
+        throw std::runtime_error("Empty Ogg file");
+    // the identification header sits alone on the first page
+    size_t segments = page[26];
+    if (!(page[5] & 0x02) || segments == 0 || page[27 + segments - 1] == 255)
+        throw std::runtime_error("Bad Ogg identification page");
+    size_t needed = header_packet_count(page);
+    opus = needed == 2;
+    serial = get_4le(&page[14]);
+    first_seqno = get_4le(&page[18]) + 1;
+    first_page_size = page.size();
+
+    vector<vector<byte>> ret;
+    ret.emplace_back(page.begin() + 27 + segments, page.end());
+    vector<byte> current;
+    header_end = first_page_size;
+    header_pages = 0;
+    while (ret.size() != needed)
+    {
+        if (!read_page(mediafile, page))
+            throw std::runtime_error("Truncated Ogg headers");
+        if (get_4le(&page[14]) != serial)
+            throw std::runtime_error("Multiplexed Ogg streams not supported");
+        header_end += page.size();
+        ++header_pages;
+
+        segments = page[26];
+        auto body = page.begin() + 27 + segments;
+        for (size_t i = 0; i != segments; ++i)
+        {
+            if (ret.size() == needed)  // audio must start on a fresh page
+                throw std::runtime_error("Ogg headers do not end their page");
+            current.insert(current.end(), body, body + page[27 + i]);
+            body += page[27 + i];
+            if (page[27 + i] < 255)
+            {
+                ret.push_back(std::move(current));
+                current.clear();
+            }
+        }
+    }
+    return ret;
+}
+
+TagMap OggFile::make_vcomments()
+{
+    const vector<byte>& packet = packets.at(1);
+    const char* magic = opus ? "OpusTags" : "\x03vorbis";
+    size_t magic_size = opus ? 8 : 7;
+    if (packet.size() < magic_size ||
+        std::memcmp(packet.data(), magic, magic_size) != 0)
+        throw std::runtime_error("No comment header in Ogg stream");
+
+    size_t consumed = 0;
+    TagMap ret = parse_vcomments(packet.begin() + magic_size, packet.end(),
+                                 vcomment_vendorstring, &consumed,
+                                 &vcomment_order);
+    comment_tail.assign(packet.begin() + magic_size + consumed, packet.end());
+    return ret;
+}
+
+size_t OggFile::resident_bytes() const
+{
+    size_t total = vcomment_vendorstring.capacity() + comment_tail.capacity();
+    for (const auto& packet : packets)
+        total += packet.capacity();
+    for (const auto& p : QTags)
+        total += p.first.capacity() + p.second.capacity();
+    for (const auto& p : vcomment_order)
+        total += p.first.capacity() + p.second.capacity();
+    return total;
+}
+
+void OggFile::strip_pictures()
+{
+    QTags.erase("METADATA_BLOCK_PICTURE");
+    QTags.erase("COVERART");
+}
+
+vector<byte> OggFile::make_header_pages(size_t& pages)
+{
+    // lacing values and data for every header packet after the first
+    vector<byte> lacing;
+    vector<byte> data;
+    for (size_t i = 1; i != packets.size(); ++i)
+    {
+        lacing.insert(lacing.end(), packets[i].size() / 255, 255);
+        lacing.push_back(packets[i].size() % 255);
+        data.insert(data.end(), packets[i].begin(), packets[i].end());
+    }
+
+    // keep the original page count whenever the lacing allows it, so the
+    // audio pages don't need renumbering
+    size_t total = lacing.size();
+    pages = std::max((total + 254) / 255, header_pages);
+    if (pages > total)
+        pages = (total + 254) / 255;
+
+    vector<byte> ret;
+    size_t seg = 0, pos = 0;
+    for (size_t i = 0; i != pages; ++i)
+    {
+        size_t count = total / pages + (i < total % pages ? 1 : 0);
+        bool continued = seg != 0 && lacing[seg - 1] == 255;
+        bool packet_ends = std::any_of(lacing.begin() + seg,
+                                       lacing.begin() + seg + count,
+                                       [] (byte b) { return b < 255; });
+        size_t start = ret.size();
+        ret.insert(ret.end(), {'O', 'g', 'g', 'S', 0, byte(continued)});
+        // header pages that finish a packet have granule position zero
+        ret.insert(ret.end(), 8, packet_ends ? 0 : 255);
+        ret.insert(ret.end(), 12, 0);
+        set_4le(&ret[start + 14], serial);
+        set_4le(&ret[start + 18], first_seqno + i);
+        ret.push_back(static_cast<byte>(count));
+        size_t body = 0;
+        for (size_t j = seg; j != seg + count; ++j)
+        {
+            ret.push_back(lacing[j]);
+            body += lacing[j];
+        }
+        ret.insert(ret.end(), data.begin() + pos, data.begin() + pos + body);
+        set_4le(&ret[start + 22], ogg_crc(0, &ret[start], ret.size() - start));
+        seg += count;
+        pos += body;
+    }
+    return ret;
+}
+
+bool OggFile::write_qtags()
+{
+    // the setup header goes back out unchanged, so reload it if dropped
+    if (packets.empty())
+        packets = make_packets();
+
+    vector<byte>& comment = packets.at(1);
+    const char* magic = opus ? "OpusTags" : "\x03vorbis";
+    comment.assign(magic, magic + (opus ? 8 : 7));
+    vector<byte> built = build_vcomments(QTags, vcomment_vendorstring,
+                                         &vcomment_order);
+    comment.insert(comment.end(), built.begin(), built.end());
+    comment.insert(comment.end(), comment_tail.begin(), comment_tail.end());
+    size_t pages = 0;
+    vector<byte> headers = make_header_pages(pages);
+
+    auto oggpath = fs::path(filename);
+    string outrel = filename;
+    if (!in_place)  // write a copy into a directory named for the album
+    {
+        string outname = oggpath.filename().string();
+        string filedir = QTags.at("ALBUM");
+
+        // replace forbidden characters for directory with a space
+        string no_dir_chars = ">:\"/\\|?*";
+        if (filedir.find_first_of(no_dir_chars) != string::npos)
+            for (const auto& ch : no_dir_chars)
+            {
+                auto index = filedir.find(ch);
+                if (index != string::npos)
+                    filedir[index] = ' ';
+            }
+
+        outrel = filedir + "\\" + outname;
+        fs::create_directories(filedir);
+    }
+    outfile = outrel;
+
+    // same pages, same size: nothing after the headers moves
+    uint32_t seq_delta = static_cast<uint32_t>(pages) -
+                         static_cast<uint32_t>(header_pages);
+    if (in_place && seq_delta == 0 &&
+        headers.size() == header_end - first_page_size)
+    {
+        write_at(filename, first_page_size, headers.data(), headers.size());
+        return true;
+    }
+
+    // in place, build the new file beside the original and swap it
+    // in afterwards, since the audio is still read from the original
+    string target = in_place ? outrel + ".tagtmp" : outrel;
+    std::ifstream mediafile(filename, std::ios_base::binary);
+    std::ofstream bob(target, std::ios_base::binary);
+
+    vector<char> chunk(1 << 20);
+    mediafile.read(chunk.data(), first_page_size);
+    bob.write(chunk.data(), first_page_size);
+    bob.write(reinterpret_cast<const char*>(headers.data()), headers.size());
+    mediafile.seekg(header_end);
+
+    if (seq_delta == 0)  // the audio pages go through untouched
+    {
+        while (mediafile.read(chunk.data(), chunk.size()) || mediafile.gcount())
+            bob.write(chunk.data(), mediafile.gcount());
+    }
+    else  // renumber this stream's pages, which means new checksums too
+        copy_ogg_pages(mediafile, bob, serial, seq_delta);
+    bob.close();
+    mediafile.close();
+    if (target != outrel)
+    {
+        fs::rename(target, outrel);
+        // the original now has the new layout
+        header_pages = pages;
+        header_end = first_page_size + headers.size();
+    }
+    return true;
+}
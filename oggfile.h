@@ -0,0 +1,70 @@
+#ifndef OGGFILE_H
+#define OGGFILE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <iosfwd>
+#include "audiofile.h"
+#include "vcomment.h"
+
+typedef unsigned char byte;
+extern TagMap vorbis_qtags;
+
+// CRC32 as used in Ogg page headers: polynomial 0x04C11DB7, MSB first,
+// zero initial value and no final xor. slicing-by-8 tables
+uint32_t ogg_crc(uint32_t crc, const byte* data, size_t n);
+
+// offset of the first page after the codec headers of the first logical
+// stream, i.e. where the audio starts
+uintmax_t ogg_audio_start(const std::string& path);
+
+// copies the rest of in to out page by page, shifting the sequence numbers
+// of serial's pages by seq_delta and refreshing their checksums
+void copy_ogg_pages(std::istream& in, std::ostream& out, uint32_t serial,
+                    uint32_t seq_delta);
+
+// serial and sequence number of the last of a run of whole pages
+void ogg_last_page(const byte* data, size_t n, uint32_t& serial,
+                   uint32_t& seqno);
+
+// Ogg Vorbis or Ogg Opus. the comment header is a Vorbis comment structure,
+// the same as FLAC block 4; rewriting it only regenerates the header pages
+// after the first one and streams the rest of the file through
+class OggFile : public AudioFile
+{
+public:
+    explicit OggFile(std::string_view qs, FilePrefix head = FilePrefix())
+        : AudioFile(std::move(head)), filename(qs) { }
+    TagMap& get_qtags() { return QTags; }
+    TagMap get_standard() { return vorbis_qtags; }
+    std::string get_filename() const { return filename; }
+    std::string get_outfile() const { return outfile; }
+    void drop_buffers() { std::vector<std::vector<byte>>().swap(packets); }
+    size_t resident_bytes() const;
+    void strip_pictures();
+private:
+    std::string filename;
+    std::string outfile;
+    bool opus = false;
+    uint32_t serial = 0;
+    uint32_t first_seqno = 0;       // sequence number of the second page
+    size_t header_pages = 0;        // pages after the first holding headers
+    uintmax_t first_page_size = 0;
+    uintmax_t header_end = 0;       // where the audio pages begin
+    std::vector<byte> vcomment_vendorstring;
+    VComments vcomment_order;  // filled with QTags
+    std::vector<byte> comment_tail; // framing bit or Opus binary data
+    std::vector<std::vector<byte>> make_packets();
+    std::vector<std::vector<byte>> packets = make_packets();
+    TagMap make_vcomments();
+    TagMap QTags = make_vcomments();
+    std::vector<byte> make_header_pages(size_t& pages);
+
+public:
+    bool write_qtags();
+
+};
+
+#endif // OGGFILE_H
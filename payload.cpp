@@ -0,0 +1,385 @@
+#include <fstream>
+#include <ios>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <cstring>
+#include "payload.h"
+#include "id3v1.h"
+#include "oggfile.h"
+#include "iosched.h"
+#include "id3codec.h"
+
+typedef unsigned char byte;
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+PayloadRange audio_payload(const string& path)
+{
+    std::ifstream mediafile(path, std::ios_base::binary);
+    if (!mediafile)
+        throw std::runtime_error("Unable to open " + path);
+    uintmax_t fsize = fs::file_size(path);
+    PayloadRange ret{0, fsize};
+    
+    byte head[10]{};
+    mediafile.read(reinterpret_cast<char*>(head), 10);
+    if (mediafile && std::memcmp(head, "ID3", 3) == 0)
+    {
+        ret.begin = id3_tag_extent(head);
+    }
+    else if (mediafile && std::memcmp(head, "fLaC", 4) == 0)
+    {
+        // walk block headers only, skipping the block bodies
+        uintmax_t pos = 4;
+        bool lastblock = false;
+        while (!lastblock && mediafile)
+        {
+            byte blockinfo[4]{};
+            mediafile.seekg(pos);
+            mediafile.read(reinterpret_cast<char*>(blockinfo), 4);
+            lastblock = blockinfo[0] >> 7;
+            pos += 4 + (blockinfo[1] << 16 | blockinfo[2] << 8 | blockinfo[3]);
+        }
+        ret.begin = pos;
+        return ret;
+    }
+    else if (mediafile && std::memcmp(head, "OggS", 4) == 0)
+    {
+        ret.begin = ogg_audio_start(path);
+        return ret;
+    }
+    else if (mediafile && std::memcmp(head + 4, "ftyp", 4) == 0)
+    {
+        // the media data is the body of the first mdat, wherever moov
+        // and free atoms put it
+        uintmax_t pos = 0;
+        while (mediafile && fsize - pos >= 8)
+        {
+            byte atom[16]{};
+            mediafile.seekg(pos);
+            mediafile.read(reinterpret_cast<char*>(atom), 16);
+            uintmax_t size = uintmax_t(atom[0]) << 24 | atom[1] << 16 |
+                             atom[2] << 8 | atom[3];
+            uintmax_t header = 8;
+            if (size == 1)
+            {
+                header = 16;
+                size = 0;
+                for (int i = 8; i != 16; ++i)
+                    size = size << 8 | atom[i];
+            }
+            else if (size == 0)
+                size = fsize - pos;
+            if (size < header || size > fsize - pos)
+                break;
+            if (std::memcmp(atom + 4, "mdat", 4) == 0)
+                return PayloadRange{ pos + header, pos + size };
+            pos += size;
+        }
+        throw std::runtime_error("No mdat atom in " + path);
+    }
+    
+    // ID3v1, APEv2 and Lyrics3 all sit after the audio
+    uintmax_t tail_size = read_tail(path).size;
+    if (fsize - tail_size > ret.begin)
+        ret.end = fsize - tail_size;
+    return ret;
+}
+
+namespace {
+
+// xxHash64, streamed: 32 byte stripes over four lanes, the tail folded
+// in by digest(). constexpr so the reference vectors below are checked
+// at compile time
+class Xxh64
+{
+public:
+    constexpr explicit Xxh64(uint64_t seed = 0)
+        : v{ seed + p1 + p2, seed + p2, seed, seed - p1 }, seed(seed)
+    {}
+
+    constexpr void update(const byte* data, size_t n)
+    {
+        total += n;
+        if (held + n < 32)
+        {
+            copy(stripe + held, data, n);
+            held += n;
+            return;
+        }
+        if (held != 0)
+        {
+            size_t fill = 32 - held;
+            copy(stripe + held, data, fill);
+            consume(stripe);
+            data += fill;
+            n -= fill;
+            held = 0;
+        }
+        for (; n >= 32; n -= 32, data += 32)
+            consume(data);
+        copy(stripe, data, n);
+        held = n;
+    }
+
+    constexpr uint64_t digest() const
+    {
+        uint64_t h = 0;
+        if (total >= 32)
+        {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (uint64_t lane : v)
+                h = (h ^ round(0, lane)) * p1 + p4;
+        }
+        else
+            h = seed + p5;
+        h += total;
+        size_t i = 0;
+        for (; i + 8 <= held; i += 8)
+            h = rotl(h ^ round(0, load(stripe + i, 8)), 27) * p1 + p4;
+        if (i + 4 <= held)
+        {
+            h = rotl(h ^ load(stripe + i, 4) * p1, 23) * p2 + p3;
+            i += 4;
+        }
+        for (; i != held; ++i)
+            h = rotl(h ^ stripe[i] * p5, 11) * p1;
+        h ^= h >> 33;
+        h *= p2;
+        h ^= h >> 29;
+        h *= p3;
+        return h ^ h >> 32;
+    }
+
+    constexpr uint64_t length() const { return total; }
+
+private:
+    static constexpr uint64_t p1 = 11400714785074694791ull;
+    static constexpr uint64_t p2 = 14029467366897019727ull;
+    static constexpr uint64_t p3 = 1609587929392839161ull;
+    static constexpr uint64_t p4 = 9650029242287828579ull;
+    static constexpr uint64_t p5 = 2870177450012600261ull;
+
+    uint64_t v[4];
+    uint64_t seed;
+    byte stripe[32]{};
+    size_t held = 0;
+    uint64_t total = 0;
+
+    static constexpr uint64_t rotl(uint64_t x, int r) { return x << r | x >> (64 - r); }
+    static constexpr uint64_t round(uint64_t acc, uint64_t in)
+    {
+        return rotl(acc + in * p2, 31) * p1;
+    }
+    // little-endian, whatever the host
+    static constexpr uint64_t load(const byte* p, int n)
+    {
+        uint64_t x = 0;
+        for (int i = n - 1; i >= 0; --i)
+            x = x << 8 | p[i];
+        return x;
+    }
+    // at most a stripe, so a loop costs nothing over memcpy
+    static constexpr void copy(byte* to, const byte* from, size_t n)
+    {
+        for (size_t i = 0; i != n; ++i)
+            to[i] = from[i];
+    }
+    constexpr void consume(const byte* p)
+    {
+        for (int i = 0; i != 4; ++i)
+            v[i] = round(v[i], load(p + 8 * i, 8));
+    }
+};
+
+// hashes s[0, n) fed in two pieces split at cut, so the stripe
+// carry-over is checked along with the arithmetic
+constexpr uint64_t xxh64_of(const char* s, size_t n, uint64_t seed,
+                            size_t cut)
+{
+    byte buf[128]{};
+    for (size_t i = 0; i != n; ++i)
+        buf[i] = byte(s[i]);
+    Xxh64 hash(seed);
+    hash.update(buf, cut);
+    hash.update(buf + cut, n - cut);
+    return hash.digest();
+}
+
+constexpr char spam[] = "Nobody inspects the spammish repetition";
+constexpr char digits[] = "0123456789012345678901234567890123456789"
+                          "0123456789012345678901234567890123456789"
+                          "01234567890123456789";
+constexpr uint64_t golden = 0x9E3779B97F4A7C15ull;
+
+// reference values from the xxHash implementation
+static_assert(xxh64_of("", 0, 0, 0) == 0xEF46DB3751D8E999ull, "empty");
+static_assert(xxh64_of("", 0, 1, 0) == 0xD5AFBA1336A3BE4Bull, "empty, seeded");
+static_assert(xxh64_of("a", 1, 0, 0) == 0xD24EC4F1A98C6E5Bull, "1 byte");
+static_assert(xxh64_of("abc", 3, 0, 1) == 0x44BC2CF5AD770999ull, "3 bytes");
+static_assert(xxh64_of("abc", 3, golden, 2) == 0x2ED0F59D6B43AC8Bull,
+              "3 bytes, seeded");
+static_assert(xxh64_of(spam, 39, 0, 0) == 0xFBCEA83C8A378BF1ull, "39 bytes");
+static_assert(xxh64_of(spam, 39, golden, 31) == 0xEB8B157CA26CBF34ull,
+              "39 bytes, seeded");
+static_assert(xxh64_of(digits, 100, 0, 5) == 0xF80E7B96315AFFFAull,
+              "100 bytes");
+static_assert(xxh64_of(digits, 100, golden, 64) == 0x14D1D80A91B9EA55ull,
+              "100 bytes, seeded");
+
+// the bytes a payload is hashed and compared by: the audio range as it
+// is, or for Ogg each page without its sequence number and checksum,
+// since those change whenever the header page count does
+class PayloadReader
+{
+public:
+    explicit PayloadReader(const string& path) : path(path)
+    {
+        PayloadRange range = audio_payload(path);
+        mediafile.open(path, std::ios_base::binary);
+        char magic[4]{};
+        mediafile.read(magic, 4);
+        ogg = std::memcmp(magic, "OggS", 4) == 0;
+        mediafile.seekg(range.begin);
+        left = range.end - range.begin;
+    }
+
+    // up to n bytes, 0 once it's all been read
+    size_t read(byte* out, size_t n)
+    {
+        if (!ogg)
+        {
+            n = std::min<uintmax_t>(n, left);
+            mediafile.read(reinterpret_cast<char*>(out), n);
+            if (static_cast<size_t>(mediafile.gcount()) != n)
+                throw std::runtime_error("Short read hashing " + path);
+            left -= n;
+            return n;
+        }
+        if (at == page.size() && !next_page())
+            return 0;
+        n = std::min(n, page.size() - at);
+        std::memcpy(out, page.data() + at, n);
+        at += n;
+        return n;
+    }
+
+private:
+    string path;
+    std::ifstream mediafile;
+    bool ogg = false;
+    uintmax_t left = 0;
+    vector<byte> page;
+    size_t at = 0;
+
+    bool next_page()
+    {
+        byte head[27];
+        if (!mediafile.read(reinterpret_cast<char*>(head), 27))
+        {
+            if (mediafile.gcount() != 0)
+                throw std::runtime_error("Short read hashing " + path);
+            return false;
+        }
+        size_t segments = head[26];
+        byte lacing[255];
+        mediafile.read(reinterpret_cast<char*>(lacing), segments);
+        size_t body = 0;
+        for (size_t i = 0; i != segments; ++i)
+            body += lacing[i];
+        page.assign(head, head + 18);
+        page.push_back(head[26]);
+        page.insert(page.end(), lacing, lacing + segments);
+        page.resize(page.size() + body);
+        mediafile.read(reinterpret_cast<char*>(page.data() + page.size() - body),
+                       body);
+        if (!mediafile)
+            throw std::runtime_error("Short read hashing " + path);
+        at = 0;
+        return true;
+    }
+};
+
+}
+
+PayloadHash hash_payload(const string& path)
+{
+    PayloadReader payload(path);
+    Xxh64 hash;
+    vector<byte> chunk(1 << 20);
+    while (size_t n = payload.read(chunk.data(), chunk.size()))
+        hash.update(chunk.data(), n);
+    return PayloadHash{ hash.digest(), hash.length(), true };
+}
+
+bool same_payload(const string& a, const string& b)
+{
+    PayloadReader x(a), y(b);
+    vector<byte> xs(1 << 16), ys(1 << 16);
+    size_t have_x = 0, have_y = 0;
+    while (true)
+    {
+        // the readers hand out pieces of different sizes, so top both
+        // up and compare what they have in common
+        if (have_x == 0)
+            have_x = x.read(xs.data(), xs.size());
+        if (have_y == 0)
+            have_y = y.read(ys.data(), ys.size());
+        if (have_x == 0 || have_y == 0)
+            return have_x == have_y;
+        size_t n = std::min(have_x, have_y);
+        if (std::memcmp(xs.data(), ys.data(), n) != 0)
+            return false;
+        std::memmove(xs.data(), xs.data() + n, have_x - n);
+        std::memmove(ys.data(), ys.data() + n, have_y - n);
+        have_x -= n;
+        have_y -= n;
+    }
+}
+
+vector<PayloadHash> hash_payloads(const vector<string>& paths,
+                                  vector<string>* errors, unsigned threads)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, std::max<size_t>(paths.size(), 1));
+    
+    vector<PayloadHash> ret(paths.size());
+    vector<string> failures(paths.size());
+    vector<size_t> order = io_order(paths);
+    std::atomic<size_t> next{0};
+    vector<std::thread> pool;
+    for (unsigned i = 0; i != threads; ++i)
+        pool.emplace_back([&] {
+            for (size_t k = next++; k < paths.size(); k = next++)
+            {
+                size_t j = order[k];
+                try
+                {
+                    ret[j] = hash_payload(paths[j]);
+                }
+                catch (const std::exception& e)
+                {
+                    failures[j] = paths[j] + ": " + e.what();
+                }
+            }
+        });
+    for (auto& t : pool)
+        t.join();
+    if (errors)
+        for (auto& failure : failures)
+            if (!failure.empty())
+                errors->push_back(std::move(failure));
+    return ret;
+}
+
+bool verify_payload(const string& original, const string& written)
+{
+    return same_payload(original, written);
+}
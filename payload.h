@@ -0,0 +1,46 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// byte range of the audio itself, i.e. everything that isn't a tag
+struct PayloadRange
+{
+    uintmax_t begin;
+    uintmax_t end;
+};
+
+PayloadRange audio_payload(const std::string& path);
+
+// xxHash64 of the audio payload only, with its length, so files differing
+// just in their tags hash the same. an equal hash and length only makes
+// two files candidates; same_payload says whether they really match
+struct PayloadHash
+{
+    uint64_t hash = 0;
+    uintmax_t length = 0;
+    bool valid = false;  // false where the file couldn't be read
+    
+    bool operator<(const PayloadHash& o) const
+    { return length != o.length ? length < o.length : hash < o.hash; }
+};
+
+PayloadHash hash_payload(const std::string& path);
+
+// hash_payload for every path, spread over threads (0 = one per core).
+// a file that can't be read is left invalid and its error ("path: why")
+// added to errors, and the rest carry on
+std::vector<PayloadHash> hash_payloads(const std::vector<std::string>& paths,
+                                       std::vector<std::string>* errors = nullptr,
+                                       unsigned threads = 0);
+
+// compares the two payloads byte for byte
+bool same_payload(const std::string& a, const std::string& b);
+
+// true if written carries exactly the audio of original
+bool verify_payload(const std::string& original, const std::string& written);
+
+#endif // PAYLOAD_H
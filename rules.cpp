@@ -0,0 +1,297 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <regex>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <filesystem>
+#include "rules.h"
+#include "tagexport.h"
+
+using std::string;
+using std::string_view;
+using std::vector;
+namespace fs = std::filesystem;
+
+const vector<FieldNames>& field_names()
+{
+    static const vector<FieldNames> names = {
+        { "TIT2", "TITLE", "\xC2\xA9nam" }, { "TPE1", "ARTIST", "\xC2\xA9" "ART" },
+        { "TALB", "ALBUM", "\xC2\xA9" "alb" }, { "TPE2", "ALBUMARTIST", "aART" },
+        { "TYER", "DATE", "\xC2\xA9" "day" }, { "TRCK", "TRACKNUMBER", "trkn" },
+        { "TPOS", "DISCNUMBER", "disk" }, { "TCON", "GENRE", "\xC2\xA9" "gen" },
+        { "TCOM", "COMPOSER", "\xC2\xA9" "wrt" }, { "COMM", "COMMENT", "\xC2\xA9" "cmt" },
+        { "TCOP", "COPYRIGHT", "cprt" }, { "TPUB", "ORGANIZATION", "" },
+        { "TSRC", "ISRC", "" }, { "TBPM", "BPM", "" }
+    };
+    return names;
+}
+
+TagFormat tag_format(string_view path)
+{
+    AudioFormat format = AudioFormat::Unknown;
+    try
+    {
+        format = detect_format(string(path));
+    }
+    catch (const std::exception&)
+    {
+        // unreadable: nothing to map names for
+    }
+    switch (format)
+    {
+    case AudioFormat::Mp3:
+        return TagFormat::Id3;
+    case AudioFormat::Flac:
+    case AudioFormat::Ogg:
+        return TagFormat::Vorbis;
+    case AudioFormat::Mp4:
+        return TagFormat::Mp4;
+    default:
+        return TagFormat::Other;
+    }
+}
+
+static const char* name_in(const FieldNames& names, TagFormat format)
+{
+    return format == TagFormat::Id3 ? names.id3
+         : format == TagFormat::Vorbis ? names.vorbis : names.mp4;
+}
+
+string native_key(const string& key, TagFormat format)
+{
+    if (format == TagFormat::Other)
+        return key;
+    string upper = key;
+    for (auto& ch : upper)
+        ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+    for (const auto& names : field_names())
+        if (key == names.id3 || upper == names.vorbis || key == names.mp4)
+        {
+            const char* native = name_in(names, format);
+            if (*native)
+                return native;
+            break;
+        }
+    // Vorbis field names are read upper case, whatever the file has
+    return format == TagFormat::Vorbis ? upper : key;
+}
+
+// "/regex/replacement/" with '\/' for a literal slash
+static std::pair<string, string> split_substitution(const string& s, int line)
+{
+    vector<string> parts(1);
+    if (s.size() < 2 || s.front() != '/' || s.back() != '/')
+        throw std::runtime_error("Rule line " + std::to_string(line) +
+                                 ": expected /regex/replacement/");
+    for (size_t i = 1; i + 1 < s.size(); ++i)
+    {
+        if (s[i] == '\\' && s[i + 1] == '/')
+            parts.back() += s[++i];
+        else if (s[i] == '/')
+            parts.emplace_back();
+        else
+            parts.back() += s[i];
+    }
+    if (parts.size() != 2)
+        throw std::runtime_error("Rule line " + std::to_string(line) +
+                                 ": expected /regex/replacement/");
+    return { parts[0], parts[1] };
+}
+
+RuleSet RuleSet::compile(const string& text)
+{
+    RuleSet ret;
+    std::istringstream lines(text);
+    string linetext;
+    int lineno = 0;
+    while (std::getline(lines, linetext))
+    {
+        ++lineno;
+        std::istringstream words(linetext);
+        string op;
+        if (!(words >> op) || op[0] == '#')
+            continue;
+        
+        Rule rule{};
+        rule.line = lineno;
+        string rest;
+        std::getline(words >> std::ws, rest);
+        while (!rest.empty() && isspace(static_cast<unsigned char>(rest.back())))
+            rest.pop_back();
+        std::istringstream args(rest);
+        
+        auto need_key = [&] {
+            if (!(args >> rule.key))
+                throw std::runtime_error("Rule line " + std::to_string(lineno) +
+                                         ": missing field name");
+            std::getline(args >> std::ws, rest);
+        };
+        try
+        {
+            if (op == "replace" || op == "from-filename")
+            {
+                need_key();
+                auto sub = split_substitution(rest, lineno);
+                rule.kind = op == "replace" ? Rule::Replace : Rule::FromFilename;
+                rule.pattern = std::regex(sub.first);
+                rule.text = sub.second;
+            }
+            else if (op == "upper" || op == "lower" || op == "title")
+            {
+                need_key();
+                rule.kind = op == "upper" ? Rule::Upper
+                          : op == "lower" ? Rule::Lower : Rule::Title;
+            }
+            else if (op == "copy")
+            {
+                rule.kind = Rule::Copy;
+                if (!(args >> rule.source >> rule.key))
+                    throw std::runtime_error("Rule line " + std::to_string(lineno) +
+                                             ": copy needs SRC and DST");
+            }
+            else if (op == "set")
+            {
+                need_key();
+                rule.kind = Rule::Set;
+                rule.text = rest;
+            }
+            else if (op == "to-vorbis" || op == "to-id3")
+                rule.kind = op == "to-vorbis" ? Rule::ToVorbis : Rule::ToId3;
+            else
+                throw std::runtime_error("Rule line " + std::to_string(lineno) +
+                                         ": unknown rule '" + op + "'");
+        }
+        catch (const std::regex_error& e)
+        {
+            throw std::runtime_error("Rule line " + std::to_string(lineno) +
+                                     ": " + e.what());
+        }
+        ret.rules.push_back(std::move(rule));
+    }
+    return ret;
+}
+
+static bool assign(TagMap& tags, const string& key, string value)
+{
+    auto it = tags.find(key);
+    if (it != tags.end() && it->second == value)
+        return false;
+    tags[key] = std::move(value);
+    return true;
+}
+
+// only within a file of the target format: anywhere else its native
+// names are the only ones write_qtags takes, and they're left alone
+static bool rename_fields(TagMap& tags, TagFormat format, bool to_vorbis)
+{
+    if (format != (to_vorbis ? TagFormat::Vorbis : TagFormat::Id3))
+        return false;
+    bool changed = false;
+    for (const auto& names : field_names())
+    {
+        string from = to_vorbis ? names.id3 : names.vorbis;
+        string to = to_vorbis ? names.vorbis : names.id3;
+        auto it = tags.find(from);
+        if (it == tags.end())
+            continue;
+        tags[to] = std::move(it->second);
+        tags.erase(from);
+        changed = true;
+    }
+    return changed;
+}
+
+bool RuleSet::apply(TagMap& tags, string_view path) const
+{
+    bool changed = false;
+    TagFormat format = tag_format(path);
+    for (const auto& rule : rules)
+    {
+        string key = native_key(rule.key, format);
+        auto it = tags.find(key);
+        string value;
+        switch (rule.kind)
+        {
+        case Rule::Replace:
+            if (it == tags.end())
+                continue;
+            value = std::regex_replace(it->second, rule.pattern, rule.text);
+            break;
+        case Rule::Upper:
+        case Rule::Lower:
+        case Rule::Title:
+        {
+            if (it == tags.end())
+                continue;
+            value = it->second;
+            bool word_start = true;
+            for (auto& ch : value)
+            {
+                auto uch = static_cast<unsigned char>(ch);
+                if (rule.kind == Rule::Upper ||
+                    (rule.kind == Rule::Title && word_start))
+                    ch = std::toupper(uch);
+                else
+                    ch = std::tolower(uch);
+                word_start = std::isspace(uch) || ch == '(' || ch == '-';
+            }
+            break;
+        }
+        case Rule::Copy:
+        {
+            auto src = tags.find(native_key(rule.source, format));
+            if (src == tags.end())
+                continue;
+            value = src->second;
+            break;
+        }
+        case Rule::Set:
+            value = rule.text;
+            break;
+        case Rule::FromFilename:
+        {
+            string stem = fs::path(path).stem().string();
+            std::smatch m;
+            if (!std::regex_search(stem, m, rule.pattern))
+                continue;
+            value = m.format(rule.text);
+            break;
+        }
+        case Rule::ToVorbis:
+        case Rule::ToId3:
+            changed |= rename_fields(tags, format, rule.kind == Rule::ToVorbis);
+            continue;
+        }
+        changed |= assign(tags, key, std::move(value));
+    }
+    return changed;
+}
+
+vector<size_t> RuleSet::apply_all(vector<TagRow>& rows, unsigned threads) const
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, std::max<size_t>(rows.size(), 1));
+    
+    vector<char> dirty(rows.size(), 0);
+    std::atomic<size_t> next{0};
+    vector<std::thread> pool;
+    for (unsigned i = 0; i != threads; ++i)
+        pool.emplace_back([&] {
+            for (size_t j = next++; j < rows.size(); j = next++)
+                dirty[j] = apply(rows[j].tags, rows[j].path);
+        });
+    for (auto& t : pool)
+        t.join();
+    
+    vector<size_t> ret;
+    for (size_t j = 0; j != rows.size(); ++j)
+        if (dirty[j])
+            ret.push_back(j);
+    return ret;
+}
@@ -0,0 +1,76 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <regex>
+#include "audiofile.h"
+
+struct TagRow;
+
+// one compiled line of a rule file
+struct Rule
+{
+    enum Kind { Replace, Upper, Lower, Title, Copy, Set, FromFilename,
+                ToVorbis, ToId3 };
+    Kind kind;
+    std::string key;     // field operated on (destination for Copy)
+    std::string source;  // Copy source field
+    std::string text;    // Set value, or regex replacement
+    std::regex pattern;
+    int line;
+};
+
+// rules, one per line, applied in order (lines starting '#' are comments):
+//   replace KEY /regex/replacement/     regex replace within a value
+//   upper KEY | lower KEY | title KEY   case normalisation
+//   copy SRC DST                        copy a field, overwriting DST
+//   set KEY value...                    literal value
+//   from-filename KEY /regex/replacement/
+//                                       derive KEY from the file's stem
+//   to-vorbis | to-id3                  in FLAC/Ogg files, rename fields
+//                                       stored under ID3 frame ids to their
+//                                       Vorbis names; in MP3s the reverse
+// a replacement may use $1..$9. regexes are compiled once, in compile().
+// a field may be named as any format has it (TPE2, ALBUMARTIST, aART);
+// each file gets it under its own format's name, see native_key
+class RuleSet
+{
+public:
+    static RuleSet compile(const std::string& text);
+    
+    // run every rule over tags, true if anything changed
+    bool apply(TagMap& tags, std::string_view path) const;
+    
+    // apply to every row across threads (0 = one per core), returning the
+    // indices of the rows that changed
+    std::vector<size_t> apply_all(std::vector<TagRow>& rows,
+                                  unsigned threads = 0) const;
+    
+    size_t size() const { return rules.size(); }
+
+private:
+    std::vector<Rule> rules;
+};
+
+// which tag names a file keeps, by its content as open_audio_file
+// tells it, whatever its extension says
+enum class TagFormat { Id3, Vorbis, Mp4, Other };
+TagFormat tag_format(std::string_view path);
+
+// one field as ID3v2 frame id, Vorbis comment name and MP4 item atom
+// (UTF-8, (C) as U+00A9); "" where a format has no counterpart
+struct FieldNames
+{
+    const char* id3;
+    const char* vorbis;
+    const char* mp4;
+};
+const std::vector<FieldNames>& field_names();
+
+// key, named in any format's terms, as format names it; unknown keys pass
+// through, upper cased for Vorbis comments
+std::string native_key(const std::string& key, TagFormat format);
+
+#endif // RULES_H
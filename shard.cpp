@@ -0,0 +1,278 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cerrno>
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
+#include "shard.h"
+#include "batch.h"
+#include "fileio.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using std::vector;
+using std::string;
+namespace fs = std::filesystem;
+
+ShardSpec parse_shard(const string& text)
+{
+    size_t slash = text.find('/');
+    if (slash == string::npos || slash == 0 || slash + 1 == text.size() ||
+        text.find_first_not_of("0123456789/") != string::npos ||
+        text.find('/', slash + 1) != string::npos)
+        throw std::invalid_argument("Shard is not K/N: " + text);
+    ShardSpec ret;
+    ret.index = static_cast<unsigned>(std::stoul(text.substr(0, slash)));
+    ret.count = static_cast<unsigned>(std::stoul(text.substr(slash + 1)));
+    if (ret.index >= ret.count)
+        throw std::invalid_argument("Shard is not K/N: " + text);
+    return ret;
+}
+
+unsigned shard_of(std::string_view path, unsigned count)
+{
+    uint32_t hash = 2166136261u;
+    for (char ch : path)
+        hash = (hash ^ static_cast<unsigned char>(ch)) * 16777619u;
+    return hash % count;
+}
+
+vector<string> in_shard(const vector<string>& paths, ShardSpec shard)
+{
+    if (shard.count == 0)
+        return paths;
+    vector<string> ret;
+    for (const auto& path : paths)
+        if (shard_of(path, shard.count) == shard.index)
+            ret.push_back(path);
+    return ret;
+}
+
+string shard_file(const string& dir, unsigned index, const string& ext)
+{
+    return (fs::path(dir) / ("shard-" + std::to_string(index) + "." + ext)).string();
+}
+
+// one line each: "count <n> <name>" or "error <message>", escaped
+void write_shard_result(const string& file, const ShardResult& result)
+{
+    string temp = file + ".tmp";
+    {
+        std::ofstream out(temp, std::ios_base::binary | std::ios_base::trunc);
+        for (const auto& count : result.counts)
+            out << "count " << count.second << ' ' << escape_line(count.first) << '\n';
+        for (const auto& error : result.errors)
+            out << "error " << escape_line(error) << '\n';
+        out.flush();
+        if (!out)
+            throw std::runtime_error("Unable to write " + temp);
+    }
+    // the contents reach the disk before the name does, so a crash
+    // can't leave a result that is there but empty
+    sync_path(temp);
+    fs::rename(temp, file);
+    fs::path dir = fs::path(file).parent_path();
+    sync_path(dir.empty() ? "." : dir.string());
+}
+
+bool read_shard_result(const string& file, ShardResult& into)
+{
+    std::ifstream in(file, std::ios_base::binary);
+    if (!in)
+        return false;
+    string line;
+    while (std::getline(in, line))
+    {
+        if (line.rfind("error ", 0) == 0)
+            into.errors.push_back(unescape_line(line.substr(6)));
+        else if (line.rfind("count ", 0) == 0)
+        {
+            std::istringstream fields(line.substr(6));
+            uintmax_t n = 0;
+            string name;
+            fields >> n;
+            std::getline(fields >> std::ws, name);
+            into.counts[unescape_line(name)] += n;
+        }
+    }
+    return true;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+namespace {
+
+uint64_t content_hash(const string& file)
+{
+    std::ifstream in(file, std::ios_base::binary);
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    vector<char> chunk(1 << 16);
+    while (in.read(chunk.data(), chunk.size()) || in.gcount() != 0)
+        for (std::streamsize i = 0; i != in.gcount(); ++i)
+            hash = (hash ^ static_cast<unsigned char>(chunk[i])) * 1099511628211ull;
+    return hash;
+}
+
+// what makes a rerun the same job: the shard count, the worker's
+// arguments and working directory, and the contents of every argument
+// that names a file, e.g. a rules file or a .tagc to import
+string manifest_of(const vector<string>& worker, unsigned count)
+{
+    std::ostringstream out;
+    out << "count " << count << '\n'
+        << "cwd " << escape_line(fs::current_path().string()) << '\n';
+    for (size_t i = 1; i < worker.size(); ++i)
+    {
+        out << "arg " << escape_line(worker[i]) << '\n';
+        std::error_code ec;
+        if (fs::is_regular_file(worker[i], ec))
+            out << "file " << fs::file_size(worker[i]) << ' ' << std::hex
+                << content_hash(worker[i]) << std::dec << '\n';
+    }
+    return out.str();
+}
+
+// dir's results are only reused for the job that made them: the first
+// run records its manifest, a rerun has to match it
+void check_manifest(const string& dir, const string& manifest)
+{
+    string file = (fs::path(dir) / "manifest").string();
+    std::ifstream in(file, std::ios_base::binary);
+    if (in)
+    {
+        std::stringstream had;
+        had << in.rdbuf();
+        if (had.str() == manifest)
+            return;
+        throw std::runtime_error(dir + " holds shards of a different job "
+                                 "(arguments, shard count or input files "
+                                 "changed); remove it or use another --shard-dir");
+    }
+    for (const auto& entry : fs::directory_iterator(dir))
+        if (entry.path().extension() == ".result")
+            throw std::runtime_error(dir + " holds shard results with no "
+                                     "manifest; remove it or use another --shard-dir");
+    string temp = file + ".tmp";
+    {
+        std::ofstream out(temp, std::ios_base::binary | std::ios_base::trunc);
+        out << manifest;
+        out.flush();
+        if (!out)
+            throw std::runtime_error("Unable to write " + temp);
+    }
+    sync_path(temp);
+    fs::rename(temp, file);
+}
+
+// fork and exec argv with stdout and stderr sent to out and log. the
+// child only redirects and execs, so the strings are all built beforehand
+pid_t launch(const vector<string>& argv, const string& out, const string& log)
+{
+    vector<char*> args;
+    for (const auto& arg : argv)
+        args.push_back(const_cast<char*>(arg.c_str()));
+    args.push_back(nullptr);
+
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t pid = ::fork();
+    if (pid < 0)
+        throw std::runtime_error("Unable to start a shard worker");
+    if (pid == 0)
+    {
+        int out_fd = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int log_fd = ::open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0 || log_fd < 0 || ::dup2(out_fd, 1) < 0 ||
+            ::dup2(log_fd, 2) < 0)
+            ::_exit(127);
+        ::close(out_fd);
+        ::close(log_fd);
+        ::execvp(args[0], args.data());
+        ::_exit(127);
+    }
+    return pid;
+}
+
+}
+
+ShardRun run_shards(const vector<string>& worker, unsigned count,
+                    const string& dir)
+{
+    fs::create_directories(dir);
+    check_manifest(dir, manifest_of(worker, count));
+    ShardRun run;
+    vector<std::pair<unsigned, pid_t>> running;
+    for (unsigned k = 0; k != count; ++k)
+    {
+        // a shard some of whose files failed goes again; its checkpoint
+        // skips the ones that went through, so only those are retried
+        string result = shard_file(dir, k, "result");
+        ShardResult prior;
+        if (read_shard_result(result, prior) && prior.errors.empty())
+        {
+            run.reused.push_back(k);
+            continue;
+        }
+        fs::remove(result);
+        vector<string> argv = worker;
+        argv.push_back("--shard-worker=" + std::to_string(k) + "/" +
+                       std::to_string(count));
+        argv.push_back("--shard-dir=" + dir);
+        try
+        {
+            running.push_back({ k, launch(argv, shard_file(dir, k, "out"),
+                                          shard_file(dir, k, "log")) });
+        }
+        catch (const std::runtime_error&)
+        {
+            run.failed.push_back(k);
+        }
+    }
+
+    for (const auto& shard : running)
+    {
+        int status = 0;
+        while (::waitpid(shard.second, &status, 0) < 0 && errno == EINTR)
+            ;
+        // the exit status only says whether every file went well; having
+        // a result is what says the worker got through its list
+        if (fs::exists(shard_file(dir, shard.first, "result")))
+            run.ran.push_back(shard.first);
+        else
+            run.failed.push_back(shard.first);
+    }
+
+    std::sort(run.failed.begin(), run.failed.end());
+    for (unsigned k = 0; k != count; ++k)
+        read_shard_result(shard_file(dir, k, "result"), run.merged);
+    return run;
+}
+
+#else
+
+ShardRun run_shards(const vector<string>&, unsigned, const string&)
+{
+    throw std::runtime_error("Shard workers not available on this platform");
+}
+
+#endif
+
+string self_path(const char* argv0)
+{
+#ifdef __linux__
+    std::error_code ec;
+    fs::path exe = fs::read_symlink("/proc/self/exe", ec);
+    if (!ec)
+        return exe.string();
+#endif
+    return argv0;
+}
@@ -0,0 +1,73 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// splitting a batch job across worker processes, or across machines that
+// share a mount. a file's shard is a hash of its path (FNV-1a), so every
+// worker and every rerun agrees on it without talking to the others; on
+// different machines that takes the same path spelling on each
+struct ShardSpec
+{
+    unsigned index = 0;
+    unsigned count = 0;  // 0: not sharded, every path is ours
+};
+
+// "K/N" with K < N; throws invalid_argument otherwise
+ShardSpec parse_shard(const std::string& text);
+
+unsigned shard_of(std::string_view path, unsigned count);
+
+// the paths of shard, in their given order
+std::vector<std::string> in_shard(const std::vector<std::string>& paths,
+                                  ShardSpec shard);
+
+// where shard index keeps its files under dir: shard-<index>.<ext>
+std::string shard_file(const std::string& dir, unsigned index,
+                       const std::string& ext);
+
+// what one worker did: named counts, summed across shards, and the
+// per-file errors. it is written once the worker's command has run
+// through, so a shard that has one without errors is done and a rerun
+// leaves it be
+struct ShardResult
+{
+    std::map<std::string, uintmax_t> counts;
+    std::vector<std::string> errors;
+};
+
+// written to a temporary name and renamed into place, so a worker killed
+// halfway leaves no result rather than a partial one
+void write_shard_result(const std::string& file, const ShardResult& result);
+
+// adds file's counts and errors to into; false if there is no such file
+bool read_shard_result(const std::string& file, ShardResult& into);
+
+struct ShardRun
+{
+    std::vector<unsigned> ran;      // launched this time and finished
+    std::vector<unsigned> reused;   // done, without errors, by an earlier run
+    std::vector<unsigned> failed;   // launched but left no result
+    ShardResult merged;             // every done shard's, added up
+};
+
+// runs worker (an argv, program first) as one process per shard of count
+// with no result in dir yet, or one listing errors, all at once, each
+// given --shard-worker=K/N and --shard-dir=dir. its stdout goes to
+// dir/shard-K.out and stderr to dir/shard-K.log. then merges the results
+// of every shard that has one.
+// dir's manifest records the job (count, worker arguments, the contents
+// of files they name); a dir left by a different job throws instead of
+// having its results reused
+ShardRun run_shards(const std::vector<std::string>& worker, unsigned count,
+                    const std::string& dir);
+
+// this program's executable, for starting workers of it; argv0 where the
+// system won't say
+std::string self_path(const char* argv0);
+
+#endif // SHARD_H
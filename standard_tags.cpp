@@ -1,9 +1,9 @@
 #include <map>
 #include <string>
-#include <QString>
+#include "audiofile.h"
 
 
-std::map<QString, QString> standard_qtags = 
+TagMap standard_qtags = 
 {
     { "AENC", "Audio encryption"},
     { "APIC", "Attached picture" },
@@ -91,7 +91,7 @@ std::map<QString, QString> standard_qtags =
     { "WXXX", "User defined URL link frame" }
 };
 
-std::map<QString, QString> vorbis_qtags = 
+TagMap vorbis_qtags = 
 {
     {"TITLE", "Track/Work name"}, 
     {"VERSION", "Version of track title (e.g. remix info)"}, 
@@ -184,3 +184,33 @@ std::map<QString, QString> vorbis_qtags =
     {"DISC", "Disc Number"},
     {"RATING", "Rating"}
 };
+
+// iTunes ilst item atoms; the (C) sign is U+00A9 in the keys
+TagMap mp4_qtags = 
+{
+    {"\xC2\xA9" "nam", "Title"},
+    {"\xC2\xA9" "ART", "Artist"},
+    {"aART", "Album Artist"},
+    {"\xC2\xA9" "alb", "Album"},
+    {"\xC2\xA9" "day", "Year"},
+    {"\xC2\xA9" "gen", "Genre"},
+    {"\xC2\xA9" "wrt", "Composer"},
+    {"\xC2\xA9" "cmt", "Comment"},
+    {"\xC2\xA9" "grp", "Grouping"},
+    {"\xC2\xA9" "lyr", "Lyrics"},
+    {"\xC2\xA9" "too", "Encoder"},
+    {"\xC2\xA9" "wrk", "Work"},
+    {"\xC2\xA9" "mvn", "Movement Name"},
+    {"trkn", "Track number"},
+    {"disk", "Disc number"},
+    {"cprt", "Copyright"},
+    {"desc", "Description"},
+    {"ldes", "Long description"},
+    {"soal", "Album sort order"},
+    {"soar", "Artist sort order"},
+    {"soaa", "Album artist sort order"},
+    {"sonm", "Title sort order"},
+    {"soco", "Composer sort order"},
+    {"tvsh", "Show name"},
+    {"purd", "Purchase date"}
+};
@@ -0,0 +1,122 @@
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include "tagdiff.h"
+
+using std::vector;
+using std::string_view;
+
+namespace {
+
+const uint64_t fnv_offset = 14695981039346656037ull;
+const uint64_t fnv_prime = 1099511628211ull;
+
+uint64_t fnv1a(string_view s, uint64_t hash = fnv_offset)
+{
+    for (char ch : s)
+        hash = (hash ^ static_cast<unsigned char>(ch)) * fnv_prime;
+    return hash;
+}
+
+// a power of two at least twice n, so probe runs stay short
+size_t table_size(size_t n)
+{
+    size_t size = 16;
+    while (size < 2 * n)
+        size <<= 1;
+    return size;
+}
+
+// open addressed with linear probing; a slot is free while files is 0
+struct KeySlot
+{
+    uint64_t hash;
+    string_view key;
+    uint32_t files;
+    uint32_t values;
+    uint32_t field;
+};
+
+struct PairSlot
+{
+    uint64_t hash;
+    string_view value;
+    uint32_t key;  // its KeySlot
+    uint32_t files;
+};
+
+}
+
+TagDiff::TagDiff(const vector<const TagMap*>& files) : nfiles(files.size())
+{
+    size_t pairs = 0;
+    for (const TagMap* tags : files)
+        pairs += tags->size();
+    vector<KeySlot> keys(table_size(pairs));
+    vector<PairSlot> seen(table_size(pairs));
+    const size_t key_mask = keys.size() - 1;
+    const size_t pair_mask = seen.size() - 1;
+
+    for (const TagMap* tags : files)
+        for (const auto& tag : *tags)
+        {
+            uint64_t key_hash = fnv1a(tag.first);
+            size_t k = key_hash & key_mask;
+            while (keys[k].files != 0 &&
+                   (keys[k].hash != key_hash || keys[k].key != tag.first))
+                k = (k + 1) & key_mask;
+            if (keys[k].files == 0)
+            {
+                keys[k].hash = key_hash;
+                keys[k].key = tag.first;
+            }
+            ++keys[k].files;
+
+            // the pair hashes as key, a 0 byte, then value
+            uint64_t pair_hash = fnv1a(tag.second, key_hash * fnv_prime);
+            size_t p = pair_hash & pair_mask;
+            while (seen[p].files != 0 &&
+                   (seen[p].hash != pair_hash || seen[p].key != k ||
+                    seen[p].value != tag.second))
+                p = (p + 1) & pair_mask;
+            if (seen[p].files == 0)
+            {
+                seen[p].hash = pair_hash;
+                seen[p].value = tag.second;
+                seen[p].key = static_cast<uint32_t>(k);
+                ++keys[k].values;
+            }
+            ++seen[p].files;
+        }
+
+    // the tables are spread out by hash; gather them into fields in key order
+    vector<uint32_t> used;
+    for (size_t k = 0; k != keys.size(); ++k)
+        if (keys[k].files != 0)
+            used.push_back(static_cast<uint32_t>(k));
+    std::sort(used.begin(), used.end(), [&keys] (uint32_t a, uint32_t b)
+              { return keys[a].key < keys[b].key; });
+    all.resize(used.size());
+    for (size_t i = 0; i != used.size(); ++i)
+    {
+        KeySlot& slot = keys[used[i]];
+        slot.field = static_cast<uint32_t>(i);
+        all[i].key = slot.key;
+        all[i].files = slot.files;
+        all[i].values.reserve(slot.values);
+    }
+    for (const auto& pair : seen)
+        if (pair.files != 0)
+            all[keys[pair.key].field].values.push_back({ pair.value, pair.files });
+    for (auto& field : all)
+        std::sort(field.values.begin(), field.values.end(),
+                  [] (const Value& a, const Value& b)
+                  { return a.files != b.files ? a.files > b.files : a.text < b.text; });
+}
+
+const TagDiff::Field* TagDiff::find(string_view key) const
+{
+    auto it = std::lower_bound(all.begin(), all.end(), key,
+                               [] (const Field& f, string_view k) { return f.key < k; });
+    return it != all.end() && it->key == key ? &*it : nullptr;
+}
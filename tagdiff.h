@@ -0,0 +1,53 @@
+#ifndef TAGDIFF_H
+#define TAGDIFF_H
+
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "audiofile.h"
+
+// how the tags of a set of files compare, key by key: which are common to
+// all of them, which differ, which some lack, and each key's distinct values
+// with how many files have each. built in a single pass that hashes every
+// (key, value) pair once (FNV-1a) into flat tables sized up front, so the
+// comparisons themselves allocate nothing.
+// keys and values are views into the given maps, valid while those are
+class TagDiff
+{
+public:
+    explicit TagDiff(const std::vector<const TagMap*>& files);
+
+    struct Value
+    {
+        std::string_view text;
+        uint32_t files = 0;
+    };
+
+    struct Field
+    {
+        std::string_view key;
+        uint32_t files = 0;         // how many have the key at all
+        std::vector<Value> values;  // distinct values, most files first
+    };
+
+    // one per key any file has, in key order
+    const std::vector<Field>& fields() const { return all; }
+    // nullptr where no file has key
+    const Field* find(std::string_view key) const;
+    size_t file_count() const { return nfiles; }
+
+    // every file has it, with the one value
+    bool common(const Field& f) const
+    { return f.files == nfiles && f.values.size() == 1; }
+    // the files that have it don't agree
+    bool differs(const Field& f) const { return f.values.size() > 1; }
+    // some files lack it
+    bool missing(const Field& f) const { return f.files != nfiles; }
+
+private:
+    size_t nfiles;
+    std::vector<Field> all;
+};
+
+#endif // TAGDIFF_H
@@ -0,0 +1,464 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <iterator>
+#include <filesystem>
+#include "tagexport.h"
+#include "journal.h"
+#include "iosched.h"
+#include "batch.h"
+
+using std::vector;
+using std::string;
+
+vector<TagRow> load_tags(const vector<string>& paths, vector<string>* errors,
+                         unsigned threads)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, std::max<size_t>(paths.size(), 1));
+    
+    vector<TagRow> rows(paths.size());
+    vector<char> ok(paths.size(), 0);
+    vector<size_t> order = io_order(paths);
+    std::atomic<size_t> next{0};
+    std::mutex error_mutex;
+    vector<std::thread> pool;
+    for (unsigned i = 0; i != threads; ++i)
+        pool.emplace_back([&] {
+            for (size_t k = next++; k < paths.size(); k = next++)
+            {
+                size_t j = order[k];
+                try
+                {
+                    std::unique_ptr<AudioFile> audio(open_audio_file(paths[j]));
+                    rows[j] = { paths[j], std::move(audio->get_qtags()) };
+                    ok[j] = 1;
+                }
+                catch (const std::exception& e)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (errors)
+                        errors->push_back(paths[j] + ": " + e.what());
+                }
+            }
+        });
+    for (auto& t : pool)
+        t.join();
+    
+    vector<TagRow> ret;
+    ret.reserve(rows.size());
+    for (size_t j = 0; j != rows.size(); ++j)
+        if (ok[j])
+            ret.push_back(std::move(rows[j]));
+    return ret;
+}
+
+void stream_tags(const vector<string>& paths,
+                 const std::function<void(vector<TagRow>&)>& sink,
+                 vector<string>* errors, size_t group_size, unsigned threads)
+{
+    for (size_t i = 0; i < paths.size(); i += group_size)
+    {
+        vector<string> group(paths.begin() + i,
+                             paths.begin() + std::min(paths.size(), i + group_size));
+        vector<TagRow> rows = load_tags(group, errors, threads);
+        sink(rows);
+    }
+}
+
+static void put_u32(std::ostream& os, uint32_t v)
+{
+    char le[4] = { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+    os.write(le, 4);
+}
+
+static void put_str(std::ostream& os, const string& s)
+{
+    put_u32(os, static_cast<uint32_t>(s.size()));
+    os.write(s.data(), s.size());
+}
+
+static std::set<string> keys_of(const vector<TagRow>& rows)
+{
+    std::set<string> keys;
+    for (const auto& row : rows)
+        for (const auto& tag : row.tags)
+            keys.insert(tag.first);
+    return keys;
+}
+
+ColumnarWriter::ColumnarWriter(const string& file)
+    : file(file), os(file, std::ios_base::binary)
+{
+    os.write("TAGC", 4);
+    put_u32(os, 2);
+}
+
+void ColumnarWriter::write(const vector<TagRow>& rows)
+{
+    if (rows.empty())
+        return;  // a count of 0 would end the file
+    std::set<string> keys = keys_of(rows);
+    put_u32(os, static_cast<uint32_t>(rows.size()));
+    put_u32(os, static_cast<uint32_t>(keys.size()));
+    for (const auto& row : rows)
+        put_str(os, row.path);
+    
+    for (const auto& key : keys)
+    {
+        put_str(os, key);
+        vector<char> present((rows.size() + 7) / 8, 0);
+        string values;
+        vector<uint32_t> lengths;
+        for (size_t i = 0; i != rows.size(); ++i)
+        {
+            auto it = rows[i].tags.find(key);
+            if (it == rows[i].tags.end())
+                continue;
+            present[i / 8] |= 1 << (i % 8);
+            lengths.push_back(static_cast<uint32_t>(it->second.size()));
+            values += it->second;
+        }
+        os.write(present.data(), present.size());
+        for (auto len : lengths)
+            put_u32(os, len);
+        os.write(values.data(), values.size());
+    }
+    if (!os)
+        throw std::runtime_error("Unable to write " + file);
+}
+
+void ColumnarWriter::finish()
+{
+    put_u32(os, 0);
+    os.close();
+    if (!os)
+        throw std::runtime_error("Unable to write " + file);
+}
+
+ColumnarReader::ColumnarReader(const string& file)
+    : is(file, std::ios_base::binary)
+{
+    if (!is)
+        throw std::runtime_error("Unable to open " + file);
+    is.seekg(0, std::ios_base::end);
+    size = static_cast<uintmax_t>(is.tellg());
+    is.seekg(0);
+    if (size < 8 || get_str(4) != "TAGC" || ((version = get_u32()) != 1 &&
+                                             version != 2))
+        throw std::runtime_error(file + " is not a columnar tag file");
+}
+
+uintmax_t ColumnarReader::left()
+{
+    return size - static_cast<uintmax_t>(is.tellg());
+}
+
+uint32_t ColumnarReader::get_u32()
+{
+    unsigned char le[4]{};
+    if (!is.read(reinterpret_cast<char*>(le), 4))
+        throw std::runtime_error("Truncated columnar file");
+    return le[0] | le[1] << 8 | le[2] << 16 | uint32_t(le[3]) << 24;
+}
+
+string ColumnarReader::get_str(uint32_t n)
+{
+    if (n > left())
+        throw std::runtime_error("Truncated columnar file");
+    string s(n, '\0');
+    if (!is.read(s.data(), n))
+        throw std::runtime_error("Truncated columnar file");
+    return s;
+}
+
+bool ColumnarReader::next(vector<TagRow>& rows)
+{
+    rows.clear();
+    if (done || (version == 1 && left() == 0))
+        return false;
+    uint32_t nrows = get_u32();
+    if (version == 1)
+        done = true;  // its one group
+    else if (nrows == 0)
+    {
+        done = true;
+        return false;
+    }
+    uint32_t ncols = get_u32();
+    // a row is at least its path's length, a column its name's length
+    // and its bitmap
+    uintmax_t bitmap = (uintmax_t(nrows) + 7) / 8;
+    if (uintmax_t(nrows) * 4 > left() ||
+        uintmax_t(ncols) * (4 + bitmap) > left() - uintmax_t(nrows) * 4)
+        throw std::runtime_error("Columnar file counts exceed its size");
+    
+    rows.resize(nrows);
+    for (auto& row : rows)
+        row.path = get_str(get_u32());
+    for (uint32_t c = 0; c != ncols; ++c)
+    {
+        string key = get_str(get_u32());
+        string present = get_str(static_cast<uint32_t>(bitmap));
+        vector<uint32_t> who;
+        for (uint32_t i = 0; i != nrows; ++i)
+            if (present[i / 8] & (1 << (i % 8)))
+                who.push_back(i);
+        if (uintmax_t(who.size()) * 4 > left())
+            throw std::runtime_error("Columnar file counts exceed its size");
+        vector<uint32_t> lengths;
+        uintmax_t total = 0;
+        for (size_t k = 0; k != who.size(); ++k)
+        {
+            lengths.push_back(get_u32());
+            total += lengths.back();
+        }
+        if (total > left())
+            throw std::runtime_error("Truncated columnar file");
+        for (size_t k = 0; k != who.size(); ++k)
+            rows[who[k]].tags[key] = get_str(lengths[k]);
+    }
+    return true;
+}
+
+void write_columnar(const string& file, const vector<TagRow>& rows)
+{
+    ColumnarWriter out(file);
+    out.write(rows);
+    out.finish();
+}
+
+vector<TagRow> read_columnar(const string& file)
+{
+    ColumnarReader in(file);
+    vector<TagRow> ret, rows;
+    while (in.next(rows))
+        std::move(rows.begin(), rows.end(), std::back_inserter(ret));
+    return ret;
+}
+
+static string csv_field(const string& s)
+{
+    if (s.find_first_of(",\"\r\n") == string::npos)
+        return s;
+    string ret = "\"";
+    for (char ch : s)
+    {
+        if (ch == '"')
+            ret += '"';
+        ret += ch;
+    }
+    return ret + '"';
+}
+
+static void csv_header(std::ostream& os, const std::set<string>& keys)
+{
+    os << "path";
+    for (const auto& key : keys)
+        os << ',' << csv_field(key);
+    os << '\n';
+}
+
+static void csv_rows(std::ostream& os, const std::set<string>& keys,
+                     const vector<TagRow>& rows)
+{
+    for (const auto& row : rows)
+    {
+        os << csv_field(row.path);
+        for (const auto& key : keys)
+        {
+            os << ',';
+            auto it = row.tags.find(key);
+            if (it != row.tags.end())
+                os << csv_field(it->second);
+        }
+        os << '\n';
+    }
+}
+
+void write_csv(std::ostream& os, const vector<TagRow>& rows)
+{
+    std::set<string> keys = keys_of(rows);
+    csv_header(os, keys);
+    csv_rows(os, keys, rows);
+}
+
+static string json_string(const string& s)
+{
+    string ret = "\"";
+    for (unsigned char ch : s)
+    {
+        if (ch == '"' || ch == '\\')
+            ret += '\\', ret += ch;
+        else if (ch < 0x20)
+        {
+            char esc[7];
+            std::snprintf(esc, sizeof esc, "\\u%04x", ch);
+            ret += esc;
+        }
+        else
+            ret += ch;
+    }
+    return ret + '"';
+}
+
+void write_jsonl(std::ostream& os, const vector<TagRow>& rows)
+{
+    for (const auto& row : rows)
+    {
+        os << "{\"path\":" << json_string(row.path) << ",\"tags\":{";
+        bool first = true;
+        for (const auto& tag : row.tags)
+        {
+            if (!first)
+                os << ',';
+            first = false;
+            os << json_string(tag.first) << ':' << json_string(tag.second);
+        }
+        os << "}}\n";
+    }
+}
+
+TagWriter::TagWriter(const string& file) : file(file)
+{
+    string ext = std::filesystem::path(file).extension().string();
+    format = ext == ".csv" ? Format::Csv : ext == ".jsonl" ? Format::Jsonl
+                                                           : Format::Columnar;
+    if (format == Format::Jsonl)
+        os.open(file);
+    else if (format == Format::Columnar)
+        columnar = std::make_unique<ColumnarWriter>(file);
+    else
+    {
+        spool = file + ".spool";
+        columnar = std::make_unique<ColumnarWriter>(spool);
+    }
+}
+
+TagWriter::~TagWriter()
+{
+    if (!spool.empty())
+    {
+        columnar.reset();
+        std::error_code ec;
+        std::filesystem::remove(spool, ec);
+    }
+}
+
+void TagWriter::write(const vector<TagRow>& rows)
+{
+    if (format == Format::Jsonl)
+        write_jsonl(os, rows);
+    else
+    {
+        if (format == Format::Csv)
+            for (const auto& row : rows)
+                for (const auto& tag : row.tags)
+                    keys.insert(tag.first);
+        columnar->write(rows);
+    }
+}
+
+void TagWriter::finish()
+{
+    if (format == Format::Csv)
+    {
+        columnar->finish();
+        os.open(file);
+        csv_header(os, keys);
+        ColumnarReader in(spool);
+        vector<TagRow> rows;
+        while (in.next(rows))
+            csv_rows(os, keys, rows);
+    }
+    if (format == Format::Columnar)
+        columnar->finish();
+    else
+    {
+        os.close();
+        if (!os)
+            throw std::runtime_error("Unable to write " + file);
+    }
+}
+
+ImportStats import_tags(const vector<TagRow>& rows, bool replace_all,
+                        TagJournal* journal, const string& checkpoint)
+{
+    ImportStats stats;
+    vector<string> paths;
+    std::map<string, const TagRow*> by_path;
+    for (const auto& row : rows)
+    {
+        if (row.tags.empty() && !replace_all)
+            continue;
+        // a path listed twice is written once, with its last row
+        if (by_path.count(row.path) == 0)
+            paths.push_back(row.path);
+        by_path[row.path] = &row;
+    }
+    // files are read and written on a worker per core; the journal is
+    // the one thing they share
+    std::mutex journal_mutex;
+    std::atomic<size_t> files_unchanged{0}, files_written{0}, tags_changed{0};
+    BatchResult batch = run_batch(paths, [&] (const string& path)
+    {
+        const TagRow& row = *by_path.at(path);
+        std::unique_ptr<AudioFile> audio(open_audio_file(row.path));
+        TagMap& tags = audio->get_qtags();
+        size_t changed = 0;
+        for (const auto& tag : row.tags)
+        {
+            auto it = tags.find(tag.first);
+            if (it != tags.end() && it->second == tag.second)
+                continue;
+            tags[tag.first] = tag.second;
+            ++changed;
+        }
+        if (replace_all)
+            for (auto it = tags.begin(); it != tags.end(); )
+            {
+                if (row.tags.count(it->first) == 0)
+                {
+                    it = tags.erase(it);
+                    ++changed;
+                }
+                else
+                    ++it;
+            }
+        if (changed == 0)
+        {
+            ++files_unchanged;
+            return true;
+        }
+        if (journal)
+        {
+            std::lock_guard<std::mutex> lock(journal_mutex);
+            journal->record(row.path);
+        }
+        // the file itself is edited, through a temporary and rename,
+        // never copied into an album folder beside the working directory
+        audio->set_in_place(true);
+        if (!audio->write_qtags())
+            return false;
+        ++files_written;
+        tags_changed += changed;
+        return true;
+    }, checkpoint, 0);
+    stats.files_unchanged = files_unchanged;
+    stats.files_written = files_written;
+    stats.tags_changed = tags_changed;
+    stats.files_resumed = batch.resumed;
+    stats.errors = std::move(batch.errors);
+    return stats;
+}
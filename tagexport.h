@@ -0,0 +1,121 @@
+#ifndef TAGEXPORT_H
+#define TAGEXPORT_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <ostream>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include "audiofile.h"
+
+class TagJournal;
+
+// one file's tags, as exported/imported
+struct TagRow
+{
+    std::string path;
+    TagMap tags;
+};
+
+// parse the tags of every path across threads (0 = one per core).
+// unreadable files are left out and reported through errors
+std::vector<TagRow> load_tags(const std::vector<std::string>& paths,
+                              std::vector<std::string>* errors = nullptr,
+                              unsigned threads = 0);
+
+// as load_tags, but group_size paths at a time: each group's rows go to
+// sink before the next group is read, so only one group is ever held
+void stream_tags(const std::vector<std::string>& paths,
+                 const std::function<void(std::vector<TagRow>&)>& sink,
+                 std::vector<std::string>* errors = nullptr,
+                 size_t group_size = 1024, unsigned threads = 0);
+
+// columnar file: "TAGC", version 2, then row groups, each a row count,
+// a key count, the path column, then per tag key its name, a presence
+// bitmap, the value lengths and the value bytes. a row count of 0 ends
+// the file. version 1, a single group with no end, is still read.
+// a cell absent from the bitmap means "no such tag" on export and
+// "leave alone" on import
+class ColumnarWriter
+{
+public:
+    explicit ColumnarWriter(const std::string& file);
+    void write(const std::vector<TagRow>& rows);  // one group
+    void finish();  // writes the end; throws if any write failed
+
+private:
+    std::string file;
+    std::ofstream os;
+};
+
+// every count and length is checked against what is left of the file
+// before anything is allocated for it, so a damaged or hostile file
+// throws rather than asking for gigabytes
+class ColumnarReader
+{
+public:
+    explicit ColumnarReader(const std::string& file);
+    // the next group into rows; false at the end
+    bool next(std::vector<TagRow>& rows);
+
+private:
+    std::ifstream is;
+    uintmax_t size = 0;
+    uint32_t version = 0;
+    bool done = false;
+    
+    uintmax_t left();
+    uint32_t get_u32();
+    std::string get_str(uint32_t n);
+};
+
+void write_columnar(const std::string& file, const std::vector<TagRow>& rows);
+std::vector<TagRow> read_columnar(const std::string& file);
+
+void write_csv(std::ostream& os, const std::vector<TagRow>& rows);
+void write_jsonl(std::ostream& os, const std::vector<TagRow>& rows);
+
+// rows written a group at a time in the format file's extension picks:
+// .csv, .jsonl, else columnar. a CSV header names every key, so its rows
+// are spooled to a columnar file beside it and copied out by finish
+class TagWriter
+{
+public:
+    explicit TagWriter(const std::string& file);
+    ~TagWriter();
+    void write(const std::vector<TagRow>& rows);
+    void finish();
+
+private:
+    enum class Format { Columnar, Csv, Jsonl } format;
+    std::string file;
+    std::string spool;
+    std::set<std::string> keys;
+    std::ofstream os;
+    std::unique_ptr<ColumnarWriter> columnar;
+};
+
+struct ImportStats
+{
+    size_t files_written = 0;
+    size_t files_unchanged = 0;
+    size_t tags_changed = 0;
+    size_t files_resumed = 0;  // done by an earlier run, per the checkpoint
+    std::vector<std::string> errors;
+};
+
+// apply rows back through write_qtags, opening and writing only the files
+// where some given tag actually differs from what is on disk. with
+// replace_all, tags missing from a row are removed rather than left alone.
+// files are edited in place, across threads, a journal first recording
+// each. a file that fails is reported in errors without stopping the
+// rest, and with a checkpoint a rerun skips files an interrupted run
+// already did
+ImportStats import_tags(const std::vector<TagRow>& rows,
+                        bool replace_all = false, TagJournal* journal = nullptr,
+                        const std::string& checkpoint = "");
+
+#endif // TAGEXPORT_H
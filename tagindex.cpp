@@ -0,0 +1,337 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <filesystem>
+#include <system_error>
+#include "tagindex.h"
+
+using std::vector;
+using std::string;
+using std::string_view;
+
+// a track slot no longer in use has no path
+static const uint32_t no_string = UINT32_MAX;
+
+FileStamp FileStamp::of(const string& path)
+{
+    std::error_code ec;
+    FileStamp ret;
+    auto size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return ret;
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec)
+        return ret;
+    ret.size = size;
+    ret.mtime = mtime.time_since_epoch().count();
+    return ret;
+}
+
+TagIndex::StrId TagIndex::intern(string_view s)
+{
+    auto it = string_ids.find(s);
+    if (it != string_ids.end())
+    {
+        ++string_refs[it->second];
+        return it->second;
+    }
+    StrId id;
+    if (!free_strings.empty())
+    {
+        id = free_strings.back();
+        free_strings.pop_back();
+        strings[id] = s;
+        string_refs[id] = 1;
+    }
+    else
+    {
+        id = static_cast<StrId>(strings.size());
+        strings.emplace_back(s);
+        string_refs.push_back(1);
+    }
+    string_ids.insert({ strings[id], id });
+    return id;
+}
+
+void TagIndex::release(StrId id)
+{
+    if (--string_refs[id] != 0)
+        return;
+    string_ids.erase(strings[id]);
+    string().swap(strings[id]);
+    free_strings.push_back(id);
+}
+
+const TagIndex::StrId* TagIndex::find_string(string_view s) const
+{
+    auto it = string_ids.find(s);
+    return it == string_ids.end() ? nullptr : &it->second;
+}
+
+void TagIndex::unlist(TrackId id)
+{
+    for (const auto& kv : track_tags[id])
+    {
+        auto values = postings.find(kv.first);
+        auto it = values->second.find(strings[kv.second]);
+        auto& list = it->second;
+        auto pos = std::lower_bound(list.begin(), list.end(), id);
+        if (pos != list.end() && *pos == id)
+            list.erase(pos);
+        // the value's view goes before its string can be released
+        if (list.empty())
+            values->second.erase(it);
+        if (values->second.empty())
+            postings.erase(values);
+        release(kv.second);
+        release(kv.first);
+    }
+    track_tags[id].clear();
+}
+
+// unlist id and free its slot; the caller erases it from track_ids
+void TagIndex::drop(TrackId id)
+{
+    unlist(id);
+    release(track_paths[id]);
+    track_paths[id] = no_string;
+    free_tracks.push_back(id);
+    --live_tracks;
+}
+
+TagIndex::TrackId TagIndex::update_locked(string_view path, const TagMap& tags,
+                                          FileStamp stamp)
+{
+    StrId path_id = intern(path);
+    TrackId id;
+    auto found = track_ids.find(path_id);
+    if (found != track_ids.end())
+    {
+        id = found->second;
+        unlist(id);
+        release(path_id);  // the track already holds its path
+    }
+    else
+    {
+        if (!free_tracks.empty())
+        {
+            id = free_tracks.back();
+            free_tracks.pop_back();
+            track_paths[id] = path_id;
+        }
+        else
+        {
+            id = static_cast<TrackId>(track_paths.size());
+            track_paths.push_back(path_id);
+            track_tags.emplace_back();
+            track_stamps.emplace_back();
+        }
+        track_ids.insert({ path_id, id });
+        ++live_tracks;
+    }
+    track_stamps[id] = stamp;
+    
+    for (const auto& tag : tags)
+    {
+        StrId key = intern(tag.first);
+        StrId value = intern(tag.second);
+        auto& list = postings[key][strings[value]];
+        // ids are mostly handed out in increasing order, so outside of
+        // reused slots this is nearly always an append
+        list.insert(std::upper_bound(list.begin(), list.end(), id), id);
+        track_tags[id].push_back({ key, value });
+    }
+    return id;
+}
+
+TagIndex::TrackId TagIndex::update(string_view path, const TagMap& tags,
+                                   FileStamp stamp)
+{
+    std::unique_lock lock(mutex);
+    return update_locked(path, tags, stamp);
+}
+
+void TagIndex::update_batch(const vector<std::pair<string, TagMap>>& batch,
+                            const vector<FileStamp>& stamps)
+{
+    std::unique_lock lock(mutex);
+    for (size_t i = 0; i != batch.size(); ++i)
+        update_locked(batch[i].first, batch[i].second,
+                      i < stamps.size() ? stamps[i] : FileStamp());
+}
+
+void TagIndex::remove(string_view path)
+{
+    std::unique_lock lock(mutex);
+    const StrId* path_id = find_string(path);
+    if (!path_id)
+        return;
+    auto found = track_ids.find(*path_id);
+    if (found == track_ids.end())
+        return;
+    TrackId id = found->second;
+    track_ids.erase(found);
+    drop(id);
+}
+
+void TagIndex::remove_under(string_view dir)
+{
+    std::unique_lock lock(mutex);
+    for (auto it = track_ids.begin(); it != track_ids.end(); )
+    {
+        if (string_view(strings[it->first]).substr(0, dir.size()) == dir)
+        {
+            TrackId id = it->second;
+            it = track_ids.erase(it);
+            drop(id);
+        }
+        else
+            ++it;
+    }
+}
+
+template <typename Pred>
+vector<TagIndex::TrackId> TagIndex::collect(string_view key, string_view from,
+                                            Pred keep_going) const
+{
+    vector<TrackId> ret;
+    const StrId* key_id = find_string(key);
+    if (!key_id)
+        return ret;
+    auto values = postings.find(*key_id);
+    if (values == postings.end())
+        return ret;
+    // concatenate and sort once rather than merging list by list
+    int lists = 0;
+    for (auto it = values->second.lower_bound(from);
+         it != values->second.end() && keep_going(it->first); ++it, ++lists)
+        ret.insert(ret.end(), it->second.begin(), it->second.end());
+    if (lists > 1)
+    {
+        std::sort(ret.begin(), ret.end());
+        ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    }
+    return ret;
+}
+
+vector<TagIndex::TrackId> TagIndex::exact(string_view key, string_view value) const
+{
+    std::shared_lock lock(mutex);
+    return collect(key, value, [value] (string_view v) { return v == value; });
+}
+
+vector<TagIndex::TrackId> TagIndex::prefix(string_view key, string_view pre) const
+{
+    std::shared_lock lock(mutex);
+    return collect(key, pre, [pre] (string_view v)
+                   { return v.substr(0, pre.size()) == pre; });
+}
+
+vector<TagIndex::TrackId> TagIndex::range(string_view key, string_view lo,
+                                          string_view hi) const
+{
+    std::shared_lock lock(mutex);
+    return collect(key, lo, [hi] (string_view v)
+                   { return hi.empty() || v < hi; });
+}
+
+vector<TagIndex::TrackId> TagIndex::contains(string_view key,
+                                             string_view needle) const
+{
+    // distinct values per key are far fewer than tracks, so scanning
+    // them is still cheap
+    std::shared_lock lock(mutex);
+    vector<TrackId> ret;
+    const StrId* key_id = find_string(key);
+    if (!key_id || postings.count(*key_id) == 0)
+        return ret;
+    int lists = 0;
+    for (const auto& value : postings.at(*key_id))
+        if (value.first.find(needle) != string_view::npos)
+        {
+            ret.insert(ret.end(), value.second.begin(), value.second.end());
+            ++lists;
+        }
+    if (lists > 1)
+    {
+        std::sort(ret.begin(), ret.end());
+        ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    }
+    return ret;
+}
+
+vector<TagIndex::TrackId> TagIndex::match(string_view key, string_view op,
+                                          string_view value) const
+{
+    if (op == "=")
+        return exact(key, value);
+    else if (op == "^=")
+        return prefix(key, value);
+    else if (op == "~")
+        return contains(key, value);
+    else if (op == "<")
+        return range(key, "", value);
+    else if (op == ">=")
+        return range(key, value, "");
+    throw std::invalid_argument("Unknown query operator " + string(op));
+}
+
+string TagIndex::path(TrackId id) const
+{
+    std::shared_lock lock(mutex);
+    StrId path_id = track_paths.at(id);
+    return path_id == no_string ? string() : strings[path_id];
+}
+
+vector<string> TagIndex::paths_under(string_view dir) const
+{
+    std::shared_lock lock(mutex);
+    vector<string> ret;
+    for (const auto& track : track_ids)
+        if (string_view(strings[track.first]).substr(0, dir.size()) == dir)
+            ret.push_back(strings[track.first]);
+    return ret;
+}
+
+vector<std::pair<string, FileStamp>> TagIndex::stamps_under(string_view dir) const
+{
+    std::shared_lock lock(mutex);
+    vector<std::pair<string, FileStamp>> ret;
+    for (const auto& track : track_ids)
+        if (string_view(strings[track.first]).substr(0, dir.size()) == dir)
+            ret.push_back({ strings[track.first], track_stamps[track.second] });
+    return ret;
+}
+
+size_t TagIndex::size() const
+{
+    std::shared_lock lock(mutex);
+    return live_tracks;
+}
+
+vector<TagIndex::TrackId> TagIndex::intersect(const vector<TrackId>& a,
+                                              const vector<TrackId>& b)
+{
+    vector<TrackId> ret;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                          std::back_inserter(ret));
+    return ret;
+}
+
+vector<TagIndex::TrackId> TagIndex::unite(const vector<TrackId>& a,
+                                          const vector<TrackId>& b)
+{
+    if (a.empty())
+        return b;
+    vector<TrackId> ret;
+    ret.reserve(a.size() + b.size());
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(),
+                   std::back_inserter(ret));
+    return ret;
+}
@@ -0,0 +1,117 @@
+#ifndef TAGINDEX_H
+#define TAGINDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <shared_mutex>
+#include <cstdint>
+#include <deque>
+#include "audiofile.h"
+
+// a file's size and modification time when it was read, to tell later
+// whether it has changed since. zero when unknown, matching nothing
+struct FileStamp
+{
+    uintmax_t size = 0;
+    int64_t mtime = 0;
+    
+    // stat path now; zero if that fails
+    static FileStamp of(const std::string& path);
+    bool same_as(const FileStamp& other) const
+    {
+        return mtime != 0 && size == other.size && mtime == other.mtime;
+    }
+};
+
+// in-memory inverted index over parsed tags: for every tag key, the
+// sorted distinct values, each with a sorted postings list of track ids.
+// strings are interned once and counted; one no track uses any more is
+// freed and its slot reused, and so is a removed track's id, so a long
+// run of updates and removes (the daemon, the watcher) stays the size of
+// what is indexed now. postings are plain uint32_t vectors.
+// queries take a shared lock, so any number of readers can run while a
+// writer waits to apply a batch under the exclusive lock
+class TagIndex
+{
+public:
+    typedef uint32_t TrackId;
+    
+    // add or replace one track's tags, returns its id. stamp is the
+    // file's as of the read the tags came from
+    TrackId update(std::string_view path, const TagMap& tags,
+                   FileStamp stamp = FileStamp());
+    void remove(std::string_view path);
+    // drop every track whose path starts with dir, e.g. a directory moved away
+    void remove_under(std::string_view dir);
+    
+    // apply many updates under a single exclusive lock, stamps[i] being
+    // batch[i]'s if given
+    void update_batch(const std::vector<std::pair<std::string, TagMap>>& batch,
+                      const std::vector<FileStamp>& stamps = {});
+    
+    std::vector<TrackId> exact(std::string_view key, std::string_view value) const;
+    std::vector<TrackId> prefix(std::string_view key, std::string_view prefix) const;
+    // lo <= value < hi, compared as strings; empty hi means unbounded
+    std::vector<TrackId> range(std::string_view key, std::string_view lo,
+                               std::string_view hi) const;
+    std::vector<TrackId> contains(std::string_view key,
+                                  std::string_view needle) const;
+    // one of the above by operator: = (exact), ^= (prefix), ~ (contains),
+    // < and >= (range); throws invalid_argument for anything else
+    std::vector<TrackId> match(std::string_view key, std::string_view op,
+                               std::string_view value) const;
+    
+    // empty for an id that has since been removed
+    std::string path(TrackId id) const;
+    // every indexed path that starts with dir, in no particular order
+    std::vector<std::string> paths_under(std::string_view dir) const;
+    // the same, each with the stamp it was indexed under
+    std::vector<std::pair<std::string, FileStamp>>
+        stamps_under(std::string_view dir) const;
+    size_t size() const;
+    
+    // sorted-list set operations for combining query results
+    static std::vector<TrackId> intersect(const std::vector<TrackId>& a,
+                                          const std::vector<TrackId>& b);
+    static std::vector<TrackId> unite(const std::vector<TrackId>& a,
+                                      const std::vector<TrackId>& b);
+
+private:
+    typedef uint32_t StrId;
+    typedef std::vector<TrackId> Postings;
+    
+    // interned strings, stable in a deque so the views stay valid. each
+    // use (a track's path, a key or value it is listed under) holds a
+    // reference; intern takes one and release gives it back
+    std::deque<std::string> strings;
+    std::vector<uint32_t> string_refs;
+    std::vector<StrId> free_strings;
+    std::unordered_map<std::string_view, StrId> string_ids;
+    StrId intern(std::string_view s);
+    void release(StrId id);
+    const StrId* find_string(std::string_view s) const;
+    
+    // key id -> (value -> postings), values ordered for prefix/range
+    std::unordered_map<StrId, std::map<std::string_view, Postings>> postings;
+    // per track: its path and the (key, value) pairs it is listed under
+    std::vector<StrId> track_paths;
+    std::vector<std::vector<std::pair<StrId, StrId>>> track_tags;
+    std::vector<FileStamp> track_stamps;
+    std::unordered_map<StrId, TrackId> track_ids;
+    std::vector<TrackId> free_tracks;
+    size_t live_tracks = 0;
+    mutable std::shared_mutex mutex;
+    
+    TrackId update_locked(std::string_view path, const TagMap& tags,
+                          FileStamp stamp);
+    void unlist(TrackId id);
+    void drop(TrackId id);
+    template <typename Pred>
+    std::vector<TrackId> collect(std::string_view key,
+                                 std::string_view from, Pred keep_going) const;
+};
+
+#endif // TAGINDEX_H
@@ -0,0 +1,111 @@
+#include <vector>
+#include <string>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <set>
+#include "vcomment.h"
+
+using std::vector;
+using std::string;
+
+vector<byte> make_4le(size_t sz)
+{
+    vector<byte> ret;
+    ret.push_back(sz & 255);
+    ret.push_back((sz >> 8) & 255);
+    ret.push_back((sz >> 16) & 255);
+    ret.push_back(static_cast<byte>(sz >> 24));
+    
+    return ret;
+}
+
+int get_4le_advance(vector<byte>::const_iterator& it)
+{
+    int ret =  (*it) | (*(it + 1)) << 8 | (*(it + 2)) << 16 | (*(it + 3)) << 24;
+    it += 4;
+    return ret;
+}
+
+TagMap parse_vcomments(vector<byte>::const_iterator begin,
+                       vector<byte>::const_iterator end, vector<byte>& vendor,
+                       size_t* consumed, VComments* order)
+{
+    auto truncated = [] { return std::runtime_error("Truncated vorbis comments"); };
+    if (end - begin < 8)
+        throw truncated();
+    
+    // extract vendor string
+    auto comment_pos = begin;
+    int vendor_length = get_4le_advance(comment_pos);
+    if (vendor_length < 0 || end - comment_pos < vendor_length + 4)
+        throw truncated();
+    comment_pos += vendor_length;
+    vendor.assign(begin, comment_pos);
+
+    TagMap ret;
+    if (order)
+        order->clear();
+    int expected_comments = get_4le_advance(comment_pos);
+    for (int i = 0; i != expected_comments; ++i)
+    {
+        if (end - comment_pos < 4)
+            throw truncated();
+        int comment_length = get_4le_advance(comment_pos);
+        if (comment_length < 0 || end - comment_pos < comment_length)
+            throw truncated();
+        std::string comment(comment_pos, comment_pos + comment_length);
+        size_t eq = comment.find("=", 0);
+        std::string first = comment.substr(0, eq); // text before
+        std::string last = eq == string::npos ? "" : comment.substr(eq + 1);
+        for (auto& ch : first)  // field names are ASCII
+            ch = std::toupper(static_cast<unsigned char>(ch));
+        bool repeat = !ret.insert({first,last}).second;
+        if (order)
+            order->push_back({ first, repeat ? last : string() });
+        comment_pos += comment_length;
+    }
+    if (consumed)
+        *consumed = comment_pos - begin;
+    return ret;  
+}
+
+static void put_comment(vector<byte>& out, const string& name,
+                        const string& value)
+{
+    auto size = make_4le(name.size() + 1 + value.size());
+    out.insert(out.end(), size.begin(), size.end());
+    out.insert(out.end(), name.begin(), name.end());
+    out.push_back('=');
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+vector<byte> build_vcomments(const TagMap& tags, const vector<byte>& vendor,
+                             const VComments* order)
+{
+    vector<byte> ret(vendor);
+    ret.resize(ret.size() + 4);  // the count, once it is known
+    size_t count = 0;
+    std::set<string> written;
+    if (order)
+        for (const auto& comment : *order)
+        {
+            auto it = tags.find(comment.first);
+            if (it == tags.end())
+                continue;
+            bool first = written.insert(comment.first).second;
+            put_comment(ret, comment.first, first ? it->second : comment.second);
+            ++count;
+        }
+    for (const auto& tag : tags)
+    {
+        if (written.count(tag.first) != 0)
+            continue;
+        put_comment(ret, tag.first, tag.second);
+        ++count;
+    }
+    auto count_bytes = make_4le(count);
+    std::copy(count_bytes.begin(), count_bytes.end(), ret.begin() + vendor.size());
+    return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef VCOMMENT_H
+#define VCOMMENT_H
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstddef>
+#include "audiofile.h"
+
+typedef unsigned char byte;
+
+std::vector<byte> make_4le(size_t sz);
+int get_4le_advance(std::vector<byte>::const_iterator& it);
+
+// every comment of a structure in order, by name. a name may repeat
+// (several ARTISTs, METADATA_BLOCK_PICTUREs); the first of each has its
+// value in the TagMap and an empty one here, any repeat keeps its own
+typedef std::vector<std::pair<std::string, std::string>> VComments;
+
+// a Vorbis comment structure, as in FLAC block 4 and the Vorbis/Opus
+// comment header: vendor string, comment count, then NAME=value comments,
+// all lengths 4-byte little-endian. field names come back upper case,
+// the first value of each in the map.
+// vendor receives the vendor string with its length bytes, consumed (if
+// given) how many bytes the structure took up, since an Ogg comment packet
+// may carry more after it, and order (if given) every comment as above
+TagMap parse_vcomments(std::vector<byte>::const_iterator begin,
+                       std::vector<byte>::const_iterator end,
+                       std::vector<byte>& vendor, size_t* consumed = nullptr,
+                       VComments* order = nullptr);
+
+// the inverse, vendor as returned by parse_vcomments. given the order it
+// returned, comments go back in that order with every repeat of a name
+// still in tags kept; a name no longer in tags loses all its values, and
+// names new to tags follow the rest
+std::vector<byte> build_vcomments(const TagMap& tags,
+                                  const std::vector<byte>& vendor,
+                                  const VComments* order = nullptr);
+
+#endif // VCOMMENT_H
@@ -0,0 +1,256 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <filesystem>
+#include "watcher.h"
+#include "tagindex.h"
+#include "audiofile.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+using std::vector;
+namespace fs = std::filesystem;
+
+#ifdef __linux__
+
+namespace {
+
+bool is_audio(const string& path)
+{
+    string ext = fs::path(path).extension().string();
+    for (auto& ch : ext)
+        ch = tolower(ch);
+    return ext == ".mp3" || ext == ".flac" || ext == ".ogg" ||
+           ext == ".oga" || ext == ".opus" || ext == ".m4a" ||
+           ext == ".m4b" || ext == ".mp4";
+}
+
+class Watches
+{
+public:
+    explicit Watches(int fd) : fd(fd) { }
+    
+    // watch dir and everything below it, returns audio files already there
+    vector<string> add_tree(const string& dir)
+    {
+        vector<string> found;
+        add(dir);
+        for (const auto& entry : fs::recursive_directory_iterator(dir,
+                 fs::directory_options::skip_permission_denied))
+        {
+            if (entry.is_directory())
+                add(entry.path().string());
+            else if (entry.is_regular_file() && is_audio(entry.path().string()))
+                found.push_back(entry.path().string());
+        }
+        return found;
+    }
+    
+    const string* dir_of(int wd) const
+    {
+        auto it = dirs.find(wd);
+        return it == dirs.end() ? nullptr : &it->second;
+    }
+    
+    void forget(int wd) { dirs.erase(wd); }
+
+private:
+    int fd;
+    std::map<int, string> dirs;
+    
+    void add(const string& dir)
+    {
+        int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO
+                                   | IN_MOVED_FROM | IN_DELETE | IN_CREATE
+                                   | IN_DELETE_SELF | IN_ONLYDIR);
+        if (wd >= 0)
+            dirs[wd] = dir;
+    }
+};
+
+WatchFlush flush(TagIndex& index, std::set<string>& changed,
+                 std::set<string>& removed)
+{
+    WatchFlush ret;
+    vector<std::pair<string, TagMap>> batch;
+    vector<FileStamp> stamps;
+    for (const auto& path : changed)
+    {
+        try
+        {
+            // the parsers only read the tag headers, never the audio
+            FileStamp stamp = FileStamp::of(path);
+            std::unique_ptr<AudioFile> audio(open_audio_file(path));
+            batch.push_back({ path, audio->get_qtags() });
+            stamps.push_back(stamp);
+        }
+        catch (const std::exception&)
+        {
+            ++ret.failed;  // e.g. still being written; next event retries
+        }
+    }
+    index.update_batch(batch, stamps);
+    ret.indexed = batch.size();
+    for (const auto& path : removed)
+        index.remove(path);
+    ret.removed = removed.size();
+    changed.clear();
+    removed.clear();
+    return ret;
+}
+
+}
+
+void watch_folder(const string& dir, TagIndex& index,
+                  const std::atomic<bool>& stop,
+                  std::function<void(const WatchFlush&)> on_flush,
+                  int quiet_ms, int max_delay_ms)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Unable to start inotify");
+    Watches watches(fd);
+    watches.add_tree(dir);
+    
+    typedef std::chrono::steady_clock clock;
+    std::set<string> changed, removed;
+    clock::time_point first_pending;
+    alignas(inotify_event) char buf[65536];
+    
+    while (!stop)
+    {
+        pollfd pfd{ fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, quiet_ms);
+        bool pending = !changed.empty() || !removed.empty();
+        
+        if (ready <= 0 || (pending && clock::now() - first_pending >
+                           std::chrono::milliseconds(max_delay_ms)))
+        {
+            if (pending)
+            {
+                WatchFlush done = flush(index, changed, removed);
+                if (on_flush)
+                    on_flush(done);
+            }
+            if (ready <= 0)
+                continue;
+        }
+        
+        ssize_t len = read(fd, buf, sizeof buf);
+        for (ssize_t i = 0; i < len; )
+        {
+            auto* ev = reinterpret_cast<inotify_event*>(buf + i);
+            i += sizeof(inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                // events were dropped and there's no telling which
+                // directories they were for, so go over the whole tree:
+                // watch what's new, reread the files whose size or mtime
+                // differ from when they were indexed, and drop what the
+                // index has that's no longer there
+                if (changed.empty() && removed.empty())
+                    first_pending = clock::now();
+                vector<string> found = watches.add_tree(dir);
+                std::set<string> present(found.begin(), found.end());
+                string root = dir.back() == '/' ? dir : dir + '/';
+                std::map<string, FileStamp> indexed;
+                for (auto& entry : index.stamps_under(root))
+                {
+                    if (present.count(entry.first) == 0)
+                    {
+                        changed.erase(entry.first);
+                        removed.insert(entry.first);
+                    }
+                    else
+                        indexed.insert(std::move(entry));
+                }
+                for (auto& path : found)
+                {
+                    auto it = indexed.find(path);
+                    if (it != indexed.end() &&
+                        it->second.same_as(FileStamp::of(path)))
+                        continue;
+                    removed.erase(path);
+                    changed.insert(std::move(path));
+                }
+                continue;
+            }
+            const string* parent = watches.dir_of(ev->wd);
+            if (ev->mask & (IN_DELETE_SELF | IN_IGNORED))
+                watches.forget(ev->wd);
+            if (!parent || ev->len == 0)
+                continue;
+            string path = (fs::path(*parent) / ev->name).string();
+            
+            if (changed.empty() && removed.empty())
+                first_pending = clock::now();
+            if (ev->mask & IN_ISDIR)
+            {
+                // a directory made or moved in: watch it, then queue what
+                // is already there, since a file closed before the watch
+                // was in place sends nothing. one still being written is
+                // read again on its IN_CLOSE_WRITE
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    for (const auto& file : watches.add_tree(path))
+                    {
+                        changed.insert(file);
+                        removed.erase(file);
+                    }
+                else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                {
+                    // a directory gone: its files leave the index with
+                    // the next flush like any other removal, so one moved
+                    // straight back in only has its files reread
+                    string under = path + '/';
+                    for (auto& file : index.paths_under(under))
+                        removed.insert(std::move(file));
+                    auto it = changed.lower_bound(under);
+                    while (it != changed.end() &&
+                           it->compare(0, under.size(), under) == 0)
+                        it = changed.erase(it);
+                }
+                continue;
+            }
+            if (!is_audio(path))
+                continue;
+            // only the last event for a path matters. IN_CREATE is for
+            // directories alone: a file created is not yet a file written
+            if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            {
+                changed.insert(path);
+                removed.erase(path);
+            }
+            else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                removed.insert(path);
+                changed.erase(path);
+            }
+        }
+    }
+    if (!changed.empty() || !removed.empty())
+    {
+        WatchFlush done = flush(index, changed, removed);
+        if (on_flush)
+            on_flush(done);
+    }
+    close(fd);
+}
+
+#else
+
+void watch_folder(const string&, TagIndex&, const std::atomic<bool>&,
+                  std::function<void(const WatchFlush&)>, int, int)
+{
+    throw std::runtime_error("Watch mode needs inotify (Linux only)");
+}
+
+#endif
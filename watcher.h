@@ -0,0 +1,28 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <string>
+#include <atomic>
+#include <functional>
+
+class TagIndex;
+
+// what one flush of coalesced events did to the index
+struct WatchFlush
+{
+    size_t indexed = 0;
+    size_t removed = 0;
+    size_t failed = 0;
+};
+
+// keep index in step with the audio files under dir using inotify.
+// events are collected until the tree has been quiet for quiet_ms (or
+// max_delay_ms has passed since the first pending one), then only the
+// touched files are re-read and the index updated in one batch.
+// returns once stop is set; throws where inotify isn't available
+void watch_folder(const std::string& dir, TagIndex& index,
+                  const std::atomic<bool>& stop,
+                  std::function<void(const WatchFlush&)> on_flush = nullptr,
+                  int quiet_ms = 500, int max_delay_ms = 5000);
+
+#endif // WATCHER_H